@@ -0,0 +1,264 @@
+/* Problem: Noisy Substring Matching
+ * Benchmark of computeDistances for every engine and scoring mode
+ * How to compile: g++ -O3 -pthread benchmark.cpp -o benchmark
+ * How to run (from the repository root):
+ * ./ benchmark [dictionaries] [args]
+ *
+ * For every dictionary (all the shipped ones by default), every
+ * configuration, and every query length and number of edits of the grid,
+ * queries are made by randomEdit on a random substring of a random word
+ * and scored against the whole dictionary (the word configs, which score
+ * whole words, edit a random word of length query_len instead). One line
+ * is output per point:
+ *  dictionary, words, config, query_len, edits, queries,
+ *  ns_per_query, p50_ns, p99_ns, cells_per_s, allocs_per_query, words_per_query,
+ *  trie_saved
+ * where cells are the comparisons counted by -cnt, allocations are calls
+ * of operator new, words are those scored by a DP (the nodes visited
+ * by word-bk) and trie_saved is the fraction of the cells of a word-by-word
+ * engine that the trie did not compute, as in -cnt (0 without the trie).
+ *
+ * Args:
+ *  -n [num]: queries per point (10 by default)
+ *  -s [seed]: seed of the queries (1 by default), so runs are comparable
+ *  -j [n]: score each query on n threads (1 by default)
+ *  -c [config]: only run config (repeatable; all by default)
+ *  -k [n]: find the n nearest words of each query (nearestWords) instead
+ *      of every distance (computeDistances)
+ *  -json: output a JSON array instead of CSV
+*/
+#define NOISY_NO_MAIN
+#include "noisysubstring.cpp"
+#include <chrono>
+
+/* ALLOCATION COUNTING */
+
+atomic<long long> allocCount(0);
+
+// every replaceable form of operator new is counted and allocates through
+// countedNew, and every form of operator delete releases through
+// countedDelete, so each new has its matching delete. they are not inlined,
+// so the compiler never pairs a free with a call of operator new
+[[gnu::noinline]] void *countedNew(size_t size, size_t align = 0) noexcept {
+    allocCount++;
+    size = size ? size : 1;
+    if (align <= alignof(max_align_t))
+        return malloc(size);
+    return aligned_alloc(align, (size + align - 1) / align * align);
+}
+[[gnu::noinline]] void countedDelete(void *p) noexcept {
+    free(p);
+}
+void *countedNewOrThrow(size_t size, size_t align = 0) {
+    if (void *p = countedNew(size, align))
+        return p;
+    throw bad_alloc();
+}
+
+void *operator new(size_t size) { return countedNewOrThrow(size); }
+void *operator new[](size_t size) { return countedNewOrThrow(size); }
+void *operator new(size_t size, align_val_t al) { return countedNewOrThrow(size, (size_t)al); }
+void *operator new[](size_t size, align_val_t al) { return countedNewOrThrow(size, (size_t)al); }
+void *operator new(size_t size, const nothrow_t &) noexcept { return countedNew(size); }
+void *operator new[](size_t size, const nothrow_t &) noexcept { return countedNew(size); }
+void *operator new(size_t size, align_val_t al, const nothrow_t &) noexcept { return countedNew(size, (size_t)al); }
+void *operator new[](size_t size, align_val_t al, const nothrow_t &) noexcept { return countedNew(size, (size_t)al); }
+
+void operator delete(void *p) noexcept { countedDelete(p); }
+void operator delete[](void *p) noexcept { countedDelete(p); }
+void operator delete(void *p, size_t) noexcept { countedDelete(p); }
+void operator delete[](void *p, size_t) noexcept { countedDelete(p); }
+void operator delete(void *p, align_val_t) noexcept { countedDelete(p); }
+void operator delete[](void *p, align_val_t) noexcept { countedDelete(p); }
+void operator delete(void *p, size_t, align_val_t) noexcept { countedDelete(p); }
+void operator delete[](void *p, size_t, align_val_t) noexcept { countedDelete(p); }
+void operator delete(void *p, const nothrow_t &) noexcept { countedDelete(p); }
+void operator delete[](void *p, const nothrow_t &) noexcept { countedDelete(p); }
+void operator delete(void *p, align_val_t, const nothrow_t &) noexcept { countedDelete(p); }
+void operator delete[](void *p, align_val_t, const nothrow_t &) noexcept { countedDelete(p); }
+
+/* CONFIGURATIONS */
+
+struct BenchConfig {
+    const char *name;
+    Engine engine;
+    bool o, b, idx, trie, word, bk;
+};
+const BenchConfig configs[] = {
+    {"suffix", ENGINE_SUFFIX, 0, 0, 0, 0, 0, 0},
+    {"sellers", ENGINE_SELLERS, 0, 0, 0, 0, 0, 0},
+    {"bitpar", ENGINE_BITPAR, 0, 0, 0, 0, 0, 0},
+    {"bitpar-o", ENGINE_BITPAR, 1, 0, 0, 0, 0, 0},
+    {"bitpar-o-b", ENGINE_BITPAR, 1, 1, 0, 0, 0, 0},
+    {"bitpar-b", ENGINE_BITPAR, 0, 1, 0, 0, 0, 0},
+    {"bitpar-b-idx", ENGINE_BITPAR, 0, 1, 1, 0, 0, 0},
+    {"simd", ENGINE_SIMD, 0, 0, 0, 0, 0, 0},
+    {"trie", ENGINE_BITPAR, 0, 0, 0, 1, 0, 0},
+    {"word", ENGINE_BITPAR, 0, 0, 0, 0, 1, 0},
+    {"word-bk", ENGINE_BITPAR, 0, 0, 0, 0, 1, 1},
+};
+const size_t queryLengths[] = {3, 6, 10, 16};
+const size_t editCounts[] = {0, 1, 2};
+
+struct BenchResult {
+    size_t queries;
+    double nsPerQuery, p50, p99, cellsPerSec, allocsPerQuery, wordsPerQuery, trieSaved;
+};
+
+// queries of length len: a random substring of a random word at least as
+// long (whole: a random word of length len), with the given number of edits
+vector<string> benchQueries(const Dictionary &dictionary, size_t len, size_t edits, int n, int seed,
+                            bool whole) {
+    vector<string> queries;
+    size_t longest = dictionary.lengthStart.size() - 2;
+    if (len > longest)
+        return queries;
+    size_t first = dictionary.lengthStart[len];
+    size_t last = whole ? dictionary.lengthStart[len + 1] : dictionary.size();
+    if (first == last)
+        return queries;
+    for (int q = 0; q < n; q++) {
+        StreamRng rng(seed, (uint64_t)len << 40 | (uint64_t)edits << 32 | q);
+        string_view word = dictionary[dictionary.byLength[first + rng.below(last - first)]];
+        string str(word.substr(rng.below(word.size() - len + 1), len));
+        queries.push_back(randomEdit(str, edits, rng));
+    }
+    return queries;
+}
+
+// score y: every distance, or the k nearest words with k > 0
+void benchQuery(const Dictionary &dictionary, string_view y, size_t k, vector<int> &distances,
+                vector<Neighbor> &neighbors) {
+    if (k > 0)
+        nearestWords(dictionary, y, k, INF, neighbors);
+    else
+        computeDistances(dictionary, y, distances);
+}
+
+BenchResult benchPoint(const Dictionary &dictionary, const vector<string> &queries, size_t k) {
+    using clock = chrono::steady_clock;
+    vector<int> distances;
+    vector<Neighbor> neighbors;
+    // warm up the per-thread buffers and caches
+    benchQuery(dictionary, queries[0], k, distances, neighbors);
+
+    BenchResult r;
+    // reserved before the count starts, so only the engine's allocations count
+    vector<double> ns;
+    ns.reserve(queries.size());
+    Metrics oldMetrics = metricsTotal();
+    long long oldAllocs = allocCount;
+    clock::time_point start = clock::now();
+    for (const string &y: queries) {
+        clock::time_point t = clock::now();
+        benchQuery(dictionary, y, k, distances, neighbors);
+        ns.push_back(chrono::duration<double, nano>(clock::now() - t).count());
+    }
+    double total = chrono::duration<double, nano>(clock::now() - start).count();
+    long long allocs = allocCount - oldAllocs;
+    Metrics metrics = metricsTotal() - oldMetrics;
+    long long cells = metrics[M_CELLS];
+
+    sort(ns.begin(), ns.end());
+    r.queries = queries.size();
+    r.nsPerQuery = total / queries.size();
+    r.p50 = ns[(ns.size() - 1) / 2];
+    r.p99 = ns[(ns.size() - 1) * 99 / 100];
+    r.cellsPerSec = cells / (total * 1e-9);
+    r.allocsPerQuery = (double)allocs / queries.size();
+    r.wordsPerQuery = (double)metrics[M_WORDS] / queries.size();
+    long long full = metrics[M_TRIE_FULL_CELLS];
+    r.trieSaved = full > 0 ? (double)(full - metrics[M_TRIE_CELLS]) / full : 0;
+    return r;
+}
+
+int main(int argc, char **argv) {
+    vector<string> dicts;
+    vector<string> only;
+    int n = 10;
+    int seed = 1;
+    size_t k = 0;
+    bool json = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            n = max(atoi(argv[++i]), 1);
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            seed = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            opt_j = max(atoi(argv[++i]), 1);
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            only.push_back(argv[++i]);
+        else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+            int n = atoi(argv[++i]);
+            if (n < 1)
+                cerr << "Unrecognized argument: -k " << argv[i] << "\n";
+            else
+                k = n;
+        }
+        else if (strcmp(argv[i], "-json") == 0)
+            json = 1;
+        else if (argv[i][0] != '-')
+            dicts.push_back(argv[i]);
+        else
+            cerr << "Unrecognized argument: " << argv[i] << "\n";
+    }
+    if (dicts.empty())
+        dicts = {"dictionary/h1.txt", "dictionary/h2.txt", "dictionary/h3.txt", "dictionary/h4.txt",
+                 "dictionary/h1_3.txt", "dictionary/n_166_len_geq_8.txt",
+                 "dictionary/n_292_len_geq_7.txt", "dictionary/n_500_len_geq_7.txt",
+                 "dictionary/wiki-100k.txt"};
+    simdLevel = simdDetect();
+
+    if (json)
+        cout << "[";
+    else
+        cout << "dictionary,words,config,query_len,edits,queries,"
+                "ns_per_query,p50_ns,p99_ns,cells_per_s,allocs_per_query,words_per_query,trie_saved\n";
+    bool firstResult = 1;
+    for (const string &path: dicts) {
+        Dictionary dictionary;
+        loadDictionary(path.c_str(), dictionary);
+        buildIndex(dictionary);
+        buildTrie(dictionary);
+        buildBKTree(dictionary);
+        for (const BenchConfig &config: configs) {
+            if (!only.empty() && find(only.begin(), only.end(), config.name) == only.end())
+                continue;
+            opt_engine = config.engine;
+            opt_o = config.o;
+            opt_b = config.b;
+            dictIndex.built = config.idx;
+            trie.built = config.trie;
+            opt_word = config.word;
+            bkTree.built = config.bk;
+            for (size_t len: queryLengths) {
+                for (size_t edits: editCounts) {
+                    vector<string> queries = benchQueries(dictionary, len, edits, n, seed, config.word);
+                    if (queries.empty())
+                        continue;
+                    BenchResult r = benchPoint(dictionary, queries, k);
+                    if (json) {
+                        cout << (firstResult ? "\n" : ",\n") << "  {\"dictionary\":\"" << path
+                             << "\",\"words\":" << dictionary.size() << ",\"config\":\"" << config.name
+                             << "\",\"query_len\":" << len << ",\"edits\":" << edits
+                             << ",\"queries\":" << r.queries << ",\"ns_per_query\":" << fixed << setprecision(0)
+                             << r.nsPerQuery << ",\"p50_ns\":" << r.p50 << ",\"p99_ns\":" << r.p99
+                             << ",\"cells_per_s\":" << r.cellsPerSec << ",\"allocs_per_query\":"
+                             << setprecision(2) << r.allocsPerQuery << ",\"words_per_query\":"
+                             << setprecision(0) << r.wordsPerQuery << ",\"trie_saved\":" << setprecision(3)
+                             << r.trieSaved << "}";
+                    } else {
+                        cout << path << "," << dictionary.size() << "," << config.name << "," << len << ","
+                             << edits << "," << r.queries << "," << fixed << setprecision(0) << r.nsPerQuery
+                             << "," << r.p50 << "," << r.p99 << "," << r.cellsPerSec << ","
+                             << setprecision(2) << r.allocsPerQuery << "," << setprecision(0)
+                             << r.wordsPerQuery << "," << setprecision(3) << r.trieSaved << "\n";
+                    }
+                    firstResult = 0;
+                }
+            }
+        }
+    }
+    if (json)
+        cout << "\n]\n";
+}
@@ -0,0 +1,146 @@
+/* Problem: Noisy Substring Matching
+ * Binary dictionary format, written by dictgen -bin and mapped by
+ * noisysubstring in place of a text dictionary.
+ *
+ * Layout (native byte order, every section starts on an 8-byte boundary):
+ *  DictHeader
+ *  pool[poolSize]: the lowercased words, each followed by '\n'
+ *  offset[numWords], length[numWords]: where every word is in the pool
+ *  byLength[numWords]: word ids sorted by length (stable)
+ *  lengthStart[maxLength + 2]: words of length len are
+ *      byLength[lengthStart[len] .. lengthStart[len + 1])
+ *  with DICT_HAS_INDEX:
+ *      wordAt[poolSize]: word of every pool offset
+ *      sa[saSize]: start of every suffix of every word, sorted by the
+ *          suffix up to the end of its word
+*/
+#ifndef DICTFORMAT_H
+#define DICTFORMAT_H
+
+#include <vector>
+#include <string_view>
+#include <algorithm>
+#include <ostream>
+#include <stdint.h>
+#include <string.h>
+
+const char DICT_MAGIC[8] = {'N', 'S', 'D', 'I', 'C', 'T', '\r', '\n'};
+const uint32_t DICT_VERSION = 1;
+const uint32_t DICT_HAS_INDEX = 1;
+
+struct DictHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t numWords;
+    uint32_t poolSize;
+    uint32_t maxLength;
+    uint32_t saSize; // 0 without DICT_HAS_INDEX
+};
+
+// byte offset of every section, and the size of the whole file
+struct DictLayout {
+    size_t pool, offset, length, byLength, lengthStart, wordAt, sa, total;
+};
+
+inline size_t dictAlign(size_t pos) {
+    return (pos + 7) & ~(size_t)7;
+}
+
+inline DictLayout dictLayout(const DictHeader &h) {
+    DictLayout l;
+    l.pool = dictAlign(sizeof(DictHeader));
+    l.offset = dictAlign(l.pool + h.poolSize);
+    l.length = dictAlign(l.offset + h.numWords * sizeof(uint32_t));
+    l.byLength = dictAlign(l.length + h.numWords * sizeof(uint32_t));
+    l.lengthStart = dictAlign(l.byLength + h.numWords * sizeof(uint32_t));
+    l.wordAt = dictAlign(l.lengthStart + ((size_t)h.maxLength + 2) * sizeof(uint32_t));
+    l.sa = dictAlign(l.wordAt + (h.flags & DICT_HAS_INDEX ? h.poolSize * sizeof(uint32_t) : 0));
+    l.total = l.sa + (size_t)h.saSize * sizeof(uint32_t);
+    return l;
+}
+
+// word ids sorted by length (stable) and the start of every length in it
+inline void dictSortByLength(const uint32_t *length, size_t numWords,
+                             std::vector<uint32_t> &byLength, std::vector<uint32_t> &lengthStart) {
+    size_t maxLength = 0;
+    for (size_t w = 0; w < numWords; w++)
+        maxLength = std::max(maxLength, (size_t)length[w]);
+    lengthStart.assign(maxLength + 2, 0);
+    for (size_t w = 0; w < numWords; w++)
+        lengthStart[length[w] + 1]++;
+    for (size_t len = 0; len <= maxLength; len++)
+        lengthStart[len + 1] += lengthStart[len];
+    std::vector<uint32_t> next(lengthStart.begin(), lengthStart.end() - 1);
+    byLength.resize(numWords);
+    for (size_t w = 0; w < numWords; w++)
+        byLength[next[length[w]]++] = w;
+}
+
+// the suffix array index of a pool: the word of every pool offset ('\n'
+// included) and the start of every suffix of every word, sorted by the
+// suffix up to the end of its word, ties by position
+inline void dictBuildIndex(const char *pool, size_t poolSize, const uint32_t *offset,
+                           const uint32_t *length, size_t numWords,
+                           std::vector<uint32_t> &wordAt, std::vector<uint32_t> &sa) {
+    wordAt.resize(poolSize);
+    sa.clear();
+    for (uint32_t w = 0; w < numWords; w++) {
+        for (uint32_t pos = offset[w]; pos <= offset[w] + length[w]; pos++)
+            wordAt[pos] = w;
+        for (uint32_t pos = offset[w]; pos < offset[w] + length[w]; pos++)
+            sa.push_back(pos);
+    }
+    auto suffix = [&](uint32_t pos) {
+        uint32_t w = wordAt[pos];
+        return std::string_view(pool + pos, offset[w] + length[w] - pos);
+    };
+    std::sort(sa.begin(), sa.end(), [&](uint32_t a, uint32_t b) {
+        int c = suffix(a).compare(suffix(b));
+        return c < 0 || (c == 0 && a < b);
+    });
+}
+
+// write a pool of words (already lowercased, each followed by '\n') and
+// their offsets and lengths in the binary format, with the suffix array
+// index if withIndex; returns 0, writing nothing, if the pool or the word
+// count does not fit the 32-bit fields of the format
+inline bool dictWriteBinary(std::ostream &out, const std::vector<char> &pool, const std::vector<uint32_t> &offset,
+                            const std::vector<uint32_t> &length, bool withIndex) {
+    size_t numWords = offset.size();
+    if (pool.size() > UINT32_MAX || numWords > UINT32_MAX)
+        return 0;
+    std::vector<uint32_t> byLength, lengthStart, wordAt, sa;
+    dictSortByLength(length.data(), numWords, byLength, lengthStart);
+    if (withIndex)
+        dictBuildIndex(pool.data(), pool.size(), offset.data(), length.data(), numWords, wordAt, sa);
+
+    DictHeader h;
+    memcpy(h.magic, DICT_MAGIC, sizeof(h.magic));
+    h.version = DICT_VERSION;
+    h.flags = withIndex ? DICT_HAS_INDEX : 0;
+    h.numWords = numWords;
+    h.poolSize = pool.size();
+    h.maxLength = lengthStart.size() - 2;
+    h.saSize = sa.size();
+    DictLayout l = dictLayout(h);
+
+    size_t pos = 0;
+    auto section = [&](size_t start, const void *data, size_t bytes) {
+        for (; pos < start; pos++)
+            out.put(0);
+        out.write((const char *)data, bytes);
+        pos += bytes;
+    };
+    section(0, &h, sizeof(h));
+    section(l.pool, pool.data(), pool.size());
+    section(l.offset, offset.data(), offset.size() * sizeof(uint32_t));
+    section(l.length, length.data(), length.size() * sizeof(uint32_t));
+    section(l.byLength, byLength.data(), byLength.size() * sizeof(uint32_t));
+    section(l.lengthStart, lengthStart.data(), lengthStart.size() * sizeof(uint32_t));
+    section(l.wordAt, wordAt.data(), wordAt.size() * sizeof(uint32_t));
+    section(l.sa, sa.data(), sa.size() * sizeof(uint32_t));
+    return 1;
+}
+
+#endif
@@ -2,7 +2,7 @@
  * Authors: Seth Baunach, Jason Tran
  * Date: 5/9/2020
  * Class: CS485-004
- * How to compile: g++ dictgen.cpp -o dictgen
+ * How to compile: g++ -O3 -pthread dictgen.cpp -o dictgen
  * How to run:
  * ./ dictgen [ARGS] < dictionary.txt > out.txt
  *
@@ -17,7 +17,16 @@
  *  -outdelim [char]: set output delimiting character ('\n' by default)
  *  -nl [len] [num]: maximum number of words of length len to pull
  *  -nn: words of length not specified by nl are not included at all (off by default)
+ *  -bin: write the words in the binary format of dictformat.h, lowercased and
+ *      split on whitespace as noisysubstring reads a text dictionary (off by default)
+ *  -idx: with -bin, also store the suffix array index used by noisysubstring -idx
+ *  -j [num]: normalize and filter words on num threads (one per core by default)
  * NOTE: There is NOT error handling for this program. Please note argument syntax well!
+ *
+ * The input is read as a stream of chunks (mapped when it is a regular file),
+ * which are split into words, matched against every -ignore string at once
+ * and normalized on -j threads, then written in input order by the main
+ * thread, which applies the -n and -nl counts.
 */
 
 #include <algorithm>
@@ -25,7 +34,18 @@
 #include <vector>
 #include <unordered_set>
 #include <unordered_map>
+#include <limits>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "dictformat.h"
 
 using namespace std;
 
@@ -41,6 +61,332 @@ char indelim = '\n';
 char outdelim = '\n';
 unordered_map<int, int> maxL;
 bool opt_nn = 0;
+bool opt_bin = 0;
+bool opt_idx = 0;
+int opt_j = max((int)thread::hardware_concurrency(), 1);
+
+/* IGNORE MATCHING */
+
+// Aho-Corasick automaton of the -ignore strings: a word is ignored if it
+// contains any of them, which one pass over it finds. go is the full
+// transition table, and hit marks the states at the end of a string or
+// with one as a suffix (through the failure links)
+struct IgnoreMatcher {
+    vector<int> go; // go[state * 256 + c]
+    vector<bool> hit;
+
+    void build(const unordered_set<string> &strs) {
+        go.assign(256, -1);
+        hit.assign(1, 0);
+        for (const string &str: strs) {
+            int state = 0;
+            for (char c: str) {
+                int &next = go[state * 256 + (unsigned char)c];
+                if (next < 0) {
+                    next = hit.size();
+                    hit.push_back(0);
+                    go.resize(go.size() + 256, -1);
+                }
+                state = go[state * 256 + (unsigned char)c];
+            }
+            hit[state] = 1;
+        }
+        // breadth-first, so the failure state of every state is done first
+        vector<int> fail(hit.size(), 0);
+        deque<int> queue;
+        for (int c = 0; c < 256; c++) {
+            int &next = go[c];
+            if (next < 0)
+                next = 0;
+            else
+                queue.push_back(next);
+        }
+        while (!queue.empty()) {
+            int state = queue.front();
+            queue.pop_front();
+            hit[state] = hit[state] || hit[fail[state]];
+            for (int c = 0; c < 256; c++) {
+                int &next = go[state * 256 + c];
+                if (next < 0)
+                    next = go[fail[state] * 256 + c];
+                else {
+                    fail[next] = go[fail[state] * 256 + c];
+                    queue.push_back(next);
+                }
+            }
+        }
+    }
+    bool matches(const char *begin, const char *end) const {
+        if (hit[0])
+            return 1;
+        int state = 0;
+        for (const char *p = begin; p < end; p++) {
+            state = go[state * 256 + (unsigned char)*p];
+            if (hit[state])
+                return 1;
+        }
+        return 0;
+    }
+};
+IgnoreMatcher ignoreMatcher;
+
+/* PIPELINE */
+
+// -rmpunc and -tolower of every character, filled once with the same
+// ispunct and tolower calls as one character at a time would make
+bool keepChar[256];
+char lowerChar[256];
+
+void buildCharTables() {
+    for (int u = 0; u < 256; u++) {
+        char c = u;
+        keepChar[u] = !opt_rmpunc || !ispunct(c) || c == '\'';
+        lowerChar[u] = opt_tolower ? tolower(c) : c;
+    }
+}
+
+// a run of whole words of the input. every chunk but the last ends with
+// indelim; the last one ends the input, and the text after its last
+// indelim is one more word, even if empty (as getline reads it)
+struct Chunk {
+    const char *begin, *end;
+    vector<char> storage; // the text, unless it is in the mapped input
+    bool last = 0;
+    // the words that passed every filter but the counts of -n and -nl
+    string words;
+    vector<uint32_t> lengths;
+    bool done = 0;
+};
+
+// normalize and filter the words of a chunk
+void processChunk(Chunk &chunk) {
+    const char *p = chunk.begin;
+    while (true) {
+        const char *stop = (const char *)memchr(p, indelim, chunk.end - p);
+        if (!stop && !chunk.last)
+            break;
+        const char *wordEnd = stop ? stop : chunk.end;
+        if (!ignoreMatcher.matches(p, wordEnd)) {
+            size_t start = chunk.words.size();
+            for (const char *c = p; c < wordEnd; c++)
+                if (keepChar[(unsigned char)*c])
+                    chunk.words.push_back(lowerChar[(unsigned char)*c]);
+            size_t len = chunk.words.size() - start;
+            if (len < ll || len > ul)
+                chunk.words.resize(start);
+            else
+                chunk.lengths.push_back(len);
+        }
+        if (!stop)
+            break;
+        p = stop + 1;
+    }
+}
+
+// the input in order: chunks waiting for a worker, and chunks in flight,
+// which the writer takes from the front once they are done
+struct Pipeline {
+    mutex lock;
+    condition_variable changed;
+    deque<shared_ptr<Chunk>> pending, inFlight;
+    bool readDone = 0;
+    bool stop = 0; // -n is reached, so the rest of the input is not needed
+};
+
+const size_t CHUNK_SIZE = 1 << 22;
+
+// hand chunk to the workers, once fewer than maxInFlight are in flight.
+// returns 0 once the writer needs no more input
+bool publish(Pipeline &pipe, shared_ptr<Chunk> chunk, size_t maxInFlight) {
+    unique_lock<mutex> guard(pipe.lock);
+    pipe.changed.wait(guard, [&] { return pipe.stop || pipe.inFlight.size() < maxInFlight; });
+    if (pipe.stop)
+        return 0;
+    pipe.pending.push_back(chunk);
+    pipe.inFlight.push_back(chunk);
+    pipe.changed.notify_all();
+    return 1;
+}
+
+// split the input into chunks, viewed in place if it is a mapped file
+void readChunks(Pipeline &pipe, size_t maxInFlight) {
+    struct stat st;
+    if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            const char *p = (const char *)map, *end = p + st.st_size;
+            while (true) {
+                auto chunk = make_shared<Chunk>();
+                chunk->begin = p;
+                chunk->end = end;
+                chunk->last = 1;
+                // end the chunk at the last indelim within CHUNK_SIZE, or
+                // the first one after it
+                if (end - p > (ptrdiff_t)CHUNK_SIZE) {
+                    const char *stop = (const char *)memrchr(p, indelim, CHUNK_SIZE);
+                    if (!stop)
+                        stop = (const char *)memchr(p + CHUNK_SIZE, indelim, end - p - CHUNK_SIZE);
+                    if (stop) {
+                        chunk->end = p = stop + 1;
+                        chunk->last = 0;
+                    }
+                }
+                if (!publish(pipe, chunk, maxInFlight) || chunk->last)
+                    break;
+            }
+            lock_guard<mutex> guard(pipe.lock);
+            pipe.readDone = 1;
+            pipe.changed.notify_all();
+            return;
+        }
+    }
+
+    vector<char> carry;
+    bool eof = 0;
+    while (!eof) {
+        auto chunk = make_shared<Chunk>();
+        vector<char> &text = chunk->storage;
+        text.swap(carry);
+        // read until the chunk is full and holds a whole word
+        size_t cut = 0;
+        while (!eof) {
+            size_t old = text.size();
+            text.resize(max(old + CHUNK_SIZE / 4, CHUNK_SIZE));
+            ssize_t got = read(STDIN_FILENO, text.data() + old, text.size() - old);
+            if (got < 0 && errno == EINTR)
+                got = 0;
+            else if (got <= 0)
+                eof = 1;
+            text.resize(old + max(got, (ssize_t)0));
+            if (text.size() < CHUNK_SIZE)
+                continue;
+            const char *stop = (const char *)memrchr(text.data(), indelim, text.size());
+            if (stop) {
+                cut = stop + 1 - text.data();
+                break;
+            }
+        }
+        if (eof)
+            chunk->last = 1;
+        else {
+            carry.assign(text.begin() + cut, text.end());
+            text.resize(cut);
+        }
+        chunk->begin = text.data();
+        chunk->end = text.data() + text.size();
+        if (!publish(pipe, chunk, maxInFlight))
+            break;
+    }
+    lock_guard<mutex> guard(pipe.lock);
+    pipe.readDone = 1;
+    pipe.changed.notify_all();
+}
+
+void processChunks(Pipeline &pipe) {
+    while (true) {
+        shared_ptr<Chunk> chunk;
+        {
+            unique_lock<mutex> guard(pipe.lock);
+            pipe.changed.wait(guard, [&] { return pipe.stop || !pipe.pending.empty() || pipe.readDone; });
+            if (pipe.stop || pipe.pending.empty())
+                return;
+            chunk = pipe.pending.front();
+            pipe.pending.pop_front();
+        }
+        processChunk(*chunk);
+        lock_guard<mutex> guard(pipe.lock);
+        chunk->done = 1;
+        pipe.changed.notify_all();
+    }
+}
+
+// the -bin output, built as the text output is written: the text is split
+// on whitespace and lowercased, as noisysubstring reads a text dictionary,
+// straight into the pool of dictformat.h, so no copy of the text is kept
+// (offsets are only meaningful while !tooLarge())
+struct BinaryWords {
+    vector<char> pool;
+    vector<uint32_t> offset, length;
+    bool inWord = 0;
+
+    void append(const string &text) {
+        for (char c: text) {
+            if (isspace((unsigned char)c)) {
+                if (inWord)
+                    endWord();
+                continue;
+            }
+            if (!inWord) {
+                offset.push_back(pool.size());
+                inWord = 1;
+            }
+            pool.push_back(tolower(c));
+        }
+    }
+    void endWord() {
+        length.push_back(pool.size() - offset.back());
+        pool.push_back('\n');
+        inWord = 0;
+    }
+    void finish() {
+        if (inWord)
+            endWord();
+    }
+    // the pool or the word count no longer fits the 32-bit fields of the format
+    bool tooLarge() const {
+        return pool.size() > UINT32_MAX || offset.size() > UINT32_MAX;
+    }
+};
+
+// write the words of the chunks in input order, counting -n and -nl, to
+// out, or with -bin to bin
+void writeChunks(Pipeline &pipe, ostream &out, BinaryWords *bin) {
+    string text;
+    while (n) {
+        shared_ptr<Chunk> chunk;
+        {
+            unique_lock<mutex> guard(pipe.lock);
+            pipe.changed.wait(guard, [&] {
+                return (!pipe.inFlight.empty() && pipe.inFlight.front()->done) ||
+                       (pipe.inFlight.empty() && pipe.readDone);
+            });
+            if (pipe.inFlight.empty())
+                break;
+            chunk = pipe.inFlight.front();
+            pipe.inFlight.pop_front();
+            pipe.changed.notify_all();
+        }
+        text.clear();
+        const char *word = chunk->words.data();
+        for (uint32_t len: chunk->lengths) {
+            if (!n)
+                break;
+            string_view x(word, len);
+            word += len;
+            auto limit = maxL.find(x.size());
+            if (limit != maxL.end()) {
+                if (limit->second != 0)
+                    limit->second--;
+                else
+                    continue;
+            } else if (opt_nn)
+                continue;
+            text.append(x);
+            text.push_back(outdelim);
+            n--;
+        }
+        if (bin) {
+            bin->append(text);
+            if (bin->tooLarge())
+                break;
+        } else
+            out.write(text.data(), text.size());
+    }
+    lock_guard<mutex> guard(pipe.lock);
+    pipe.stop = 1;
+    pipe.changed.notify_all();
+}
 
 int main(int argc, char **argv) {
 
@@ -66,50 +412,40 @@ int main(int argc, char **argv) {
             i += 2;
         } else if (strcmp(argv[i], "-nn") == 0)
             opt_nn = 1;
+        else if (strcmp(argv[i], "-bin") == 0)
+            opt_bin = 1;
+        else if (strcmp(argv[i], "-idx") == 0)
+            opt_idx = 1;
+        else if (strcmp(argv[i], "-j") == 0)
+            opt_j = max(stoi(argv[++i]), 1);
         else
             cout << "Unrecognized argument: " << argv[i] << "\n";
     }
 
-    for(string x; n && !cin.eof();) {
+    // with -bin, the words are gathered into the pool and written at the end
+    BinaryWords bin;
 
-        getline(cin, x, indelim);
-        bool skip = 0;
-        for (string ignore: ignores) {
-            if (x.find(ignore) != string::npos) {
-                skip = 1;
-                break;
-            }
-        }
-        if (skip)
-            continue;
-
-        if (opt_rmpunc) {
-            vector<char> xnew;
-            for (char c: x)
-                if (!ispunct(c) || c == '\'')
-                    xnew.push_back(c);
-            x = string(xnew.begin(), xnew.end());
-        }
+    if (n) {
+        ignoreMatcher.build(ignores);
+        buildCharTables();
+        Pipeline pipe;
+        size_t maxInFlight = 4 * opt_j;
+        thread reader(readChunks, ref(pipe), maxInFlight);
+        vector<thread> workers;
+        for (int t = 0; t < opt_j; t++)
+            workers.emplace_back(processChunks, ref(pipe));
+        writeChunks(pipe, cout, opt_bin ? &bin : nullptr);
+        reader.join();
+        for (thread &worker: workers)
+            worker.join();
+    }
 
-        if (opt_tolower) {
-            vector<char> xnew;
-            for (char c: x)
-                xnew.push_back(tolower(c));
-            x = string(xnew.begin(), xnew.end());
+    if (opt_bin) {
+        bin.finish();
+        if (!dictWriteBinary(cout, bin.pool, bin.offset, bin.length, opt_idx)) {
+            cerr << "Dictionary too large for -bin: " << bin.offset.size() << "+ words, " << bin.pool.size()
+                 << "+ pool bytes (at most " << UINT32_MAX << " of each)\n";
+            return 1;
         }
-
-        if (x.size() < ll || x.size() > ul)
-            continue;
-
-        if (maxL.find(x.size()) != maxL.end()) {
-            if (maxL[x.size()] != 0)
-                maxL[x.size()]--;
-            else
-                continue;
-        } else if (opt_nn)
-            continue;
-
-        cout << x << outdelim;
-        n--;
     }
 }
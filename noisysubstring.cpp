@@ -2,10 +2,13 @@
  * Authors: Seth Baunach, Jason Tran
  * Date: 5/9/2020
  * Class: CS485-004
- * How to compile: g++ noisysubstring.cpp -o noisysubstring
- * RECOMMEND COMPILING WITH -O3 for optimization.
+ * How to compile: g++ -pthread noisysubstring.cpp -o noisysubstring
+ * RECOMMEND COMPILING WITH -O3 for optimization. -DNOISY_NO_METRICS compiles
+ * out the counters of -cnt and -metrics.
  * How to run:
  * ./ noisysubstring [dictionary] [args]
+ * The dictionary is a text file of words, or a binary dictionary written by
+ * dictionary/dictgen -bin, which is memory-mapped instead of parsed.
  * Input >
  * -q: exit the program
  * [str]: run noisy substring algorithm on str
@@ -25,17 +28,99 @@
  *				substring's set
  *  Options:
  *      -o: output each test case and whether it succeeded or failed
- *      -s [seed]: randomize using seed, rather than time(NULL)
+ *      -s [seed]: randomize using seed, rather than time(NULL) (the same for any -j)
  *      -g [param]: sets parameter for geometric distrubtion for number of edits
+ * -v [n] [opts]:
+ *      - do n times:
+ *          - make a noisy version of a random substring of a random word
+ *          - compare the distance of every engine to the reference (suffix)
+ *					engine on every word in the dictionary, for both choices of k
+ *      - output number of mismatches and PASS/FAIL
+ *  Options:
+ *      -s [seed]: randomize using seed, rather than time(NULL)
  *
  * Args:
  *  -l: For [str] command, disable display of space-separated list of matches (on by default)
  *  -t: For [str] command, display sorted newline-separated list of all words 
  *			paired with their minimum LD.
  *  -h: For [str] command, display the dictionary file with matches highlighted (in console)
- *  -wf: For each step of k_dist, print the Wagner-Fischer Matrix
- *  -cnt: Output total number of character comparisons for each command
+ *  -wf: For each step of k_dist, print the Wagner-Fischer Matrix (bitpar falls back to sellers)
+ *  -cnt: Output total number of character comparisons for each command, with the
+ *			words scored, pruned, copied from a duplicate, given |str| for sharing no
+ *			character with it and exited early, index hits, buffer growths and the
+ *			time spent loading, filtering, scoring and printing
+ *  -metrics [file]: on exit, write every counter of -cnt since the start to file as JSON
  *  -o: Optimize by only computing WF matrices for suffixes of x of length >= |y|.
+ *			Words are scored a length at a time, and with -b the lengths too short to
+ *			reach the minimum LD are skipped (not with -idx, which orders by its bound)
+ *  -b: Abandon words as soon as they cannot tie for the minimum LD
+ *			(same matches; no effect with the -t and -wf args, which need every distance)
+ *  -idx: Build a suffix array over the dictionary at load time (or use the one
+ *			stored by dictgen -bin -idx). It answers the
+ *			exact-substring sets of -t, and with -b scores words best-first by
+ *			their q-gram bound, skipping those that cannot reach the minimum LD
+ *  -trie: Score the dictionary by a DFS over a trie of its words, so that words
+ *			sharing a prefix share its Wagner-Fischer rows (-cnt reports the
+ *			fraction of cells saved)
+ *  -k [n]: For [str] command and -batch, list the n closest words with their
+ *			minimum LD instead, ties in dictionary order. The n-th best distance so
+ *			far is the cutoff of every other word (as with -b), so a small n scores
+ *			few words in full, and with -idx stops at the first q-gram bound above it
+ *  -r [d]: like -k, but list every word within distance d (both: the n closest within d)
+ *  -word: score the whole of every word instead of its best substring, so the
+ *			distance is the Levenshtein distance of word and str (no effect with -o,
+ *			-b, -idx, -trie and -e; -ta is off)
+ *  -bk: -word, with a BK-tree of the dictionary built at load time. Its
+ *			queries, -k and -r visit only the subtrees that the triangle inequality
+ *			cannot rule out (-cnt reports the nodes visited). -t scans every word,
+ *			and so does -cost, as weighted distances need not be a metric
+ *  -align: For [str] command, also list every closest word with the start and
+ *			end of its best substring and the edit script that turns it into str
+ *			(run-length, = match, X substitution, I insertion, D deletion). -h then
+ *			highlights that substring only
+ *  -ta: type-ahead: each [str] command starts from the state of the last one.
+ *			Typing a character adds one Wagner-Fischer column per word instead of
+ *			scoring the dictionary again, and a shorter str goes back to the saved
+ *			state. Words far behind the best distance stop being extended until it
+ *			catches up with them, so the matches stay exact (no effect with -o, -wf and -word)
+ *  -j [n]: score the dictionary on n threads (1 by default); the -t command
+ *			runs n trials at once instead
+ *  -verify [n]: instead of the Input > prompt, run the -v command on n queries
+ *			(seed 1) and exit, with status 1 if any engine disagrees
+ *  -batch [file]: instead of the Input > prompt, answer every line of file
+ *			(- for stdin) with its minimum LD and closest words, then exit.
+ *			Queries are read, scored and written on separate threads, and
+ *			equal queries among 65536 lines are scored once (-cnt goes to stderr).
+ *			With -e bitpar and no -b, -cost, -trie or -word, up to 32 distinct
+ *			queries share each pass over the dictionary, packed into 64-bit words
+ *  -serve [addr]: instead of the Input > prompt, answer requests on addr
+ *			([host]:port for TCP, on 127.0.0.1 by default, or a Unix domain socket
+ *			path) until killed, one thread per connection. Every line is a request:
+ *      - [-o] [-k n] [-r d] str: the line -batch would output for str, with
+ *			these options in place of the ones the server was started with (later
+ *			words are ignored, as at the Input > prompt and in -batch)
+ *      - -stats: a JSON line of the requests, cache hits and misses, and latencies
+ *  -cache [n]: results cached by -serve, by query and options (4096 by default);
+ *			the least recently used one is dropped when full
+ *  -fmt [format]: output format of -batch and -serve: tsv (by default) or jsonl
+ *      - tsv: query<TAB>distance<TAB>space-separated closest words
+ *      - jsonl: {"query":"...","distance":n,"matches":["...",...]}
+ *      - with -k or -r, the matches are the nearest words, followed by their
+ *			distances (a 4th tsv column, "distances" in jsonl)
+ *  -cost [file]: weighted edit costs instead of unit ones (e.g. dictionary/keyboard.cost),
+ *			one rule per line, later rules winning, from 0 to 255:
+ *      - sub [from] [to] [cost]: reading a character of from in x as one of to in y
+ *      - ins [chars] [cost], del [chars] [cost]: inserting into / deleting from x
+ *			(* stands for every character, # starts a comment). Only the sellers and
+ *			suffix engines take weights (bitpar, simd and -trie fall back to sellers),
+ *			and the bounds of -b and -idx are scaled by the cheapest operation
+ *  -e [engine]: distance engine used by k_dist (bitpar by default)
+ *      - bitpar: Myers bit-vector kernel, one machine word per 64 characters
+ *					of y, O(|x|) word operations when |y| <= 64
+ *      - sellers: single semi-global Wagner-Fischer pass, O(|x||y|)
+ *      - simd: sellers on a batch of words at once, one word per 16-bit lane
+ *					(AVX2 or SSE4.1, picked at runtime)
+ *      - suffix: reference engine, one Wagner-Fischer matrix per suffix of x
 */
 #include <vector>
 #include <fstream>
@@ -45,129 +130,3479 @@
 #include <algorithm>
 #include <tuple>
 #include <set>
+#include <string_view>
 #include <random>
+#include <deque>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <list>
+#include <unordered_map>
+#include <stdint.h>
 #include <string.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "dictionary/dictformat.h"
+
+using namespace std;
+
+const int INF = numeric_limits<int>::max();
+bool opt_l = 1;
+bool opt_t = 0;
+bool opt_h = 0;
+bool opt_wf = 0;
+bool opt_o = 0;
+bool opt_cnt = 0;
+bool opt_b = 0;
+bool opt_idx = 0;
+bool opt_trie = 0;
+bool opt_ta = 0;
+bool opt_word = 0;
+bool opt_bk = 0;
+bool opt_align = 0;
+int opt_j = 1;
+size_t opt_k = 0; // 0 without -k
+int opt_r = -1;   // -1 without -r
+const char *opt_cost = nullptr;
+const char *opt_metrics = nullptr;
+
+// k_dist prints to per-thread state; computeDistances merges the -wf
+// output into cout
+thread_local ostream *wfOut = &cout;
+
+/* METRICS */
+
+// counters of the hot paths. every thread counts into its own block with
+// plain (relaxed) loads and stores, and metricsTotal() sums the blocks on
+// demand; the blocks of threads that exited are kept in retiredMetrics.
+// compiled with -DNOISY_NO_METRICS, COUNT and PHASE_TIMER expand to
+// nothing and every counter stays 0
+enum Metric {
+    M_CELLS,           // DP cells computed (the comparisons of -cnt)
+    M_WORDS,           // words scored by a DP
+    M_PRUNED,          // words skipped by a lower bound
+    M_EARLY_EXITS,     // DPs abandoned at the cutoff
+    M_INDEX_HITS,      // suffix array entries visited
+    M_ALLOCATIONS,     // growths of scratch buffers
+    M_TRIE_CELLS,      // cells computed by the trie
+    M_TRIE_FULL_CELLS, // cells a word-by-word engine would compute (distinct words only)
+    M_BK_NODES,        // BK-tree nodes visited
+    M_BK_SEARCHES,     // walks of the BK-tree
+    M_DUPLICATES,      // copies of a word given the distance of its first copy
+    M_DISJOINT,        // words sharing no character with y, given |y|
+    M_NS_LOAD,         // wall time of the phases, summed over threads
+    M_NS_FILTER,
+    M_NS_SCORE,
+    M_NS_OUTPUT,
+    NUM_METRICS
+};
+const char *metricNames[NUM_METRICS] = {
+    "cells", "words_scored", "words_pruned", "early_exits", "index_hits", "allocations",
+    "trie_cells", "trie_full_cells", "bk_nodes", "bk_searches", "duplicates", "disjoint", "load_ns", "filter_ns", "score_ns",
+    "output_ns"};
+
+struct Metrics {
+    long long v[NUM_METRICS] = {};
+    long long operator[](Metric m) const {
+        return v[m];
+    }
+    Metrics operator-(const Metrics &o) const {
+        Metrics d;
+        for (int m = 0; m < NUM_METRICS; m++)
+            d.v[m] = v[m] - o.v[m];
+        return d;
+    }
+};
+
+// a thread's block is constant-initialized, so that counting needs no
+// guard of a thread_local constructor; it is registered at its first
+// count, and folded into retiredMetrics when the thread exits
+struct ThreadMetrics {
+    atomic<long long> v[NUM_METRICS];
+    bool registered;
+};
+struct RetireMetrics {
+    ~RetireMetrics();
+};
+mutex metricsLock;
+vector<ThreadMetrics *> liveMetrics;
+Metrics retiredMetrics;
+thread_local ThreadMetrics threadMetrics;
+thread_local RetireMetrics retireMetrics;
+
+void registerMetrics() {
+    lock_guard<mutex> guard(metricsLock);
+    liveMetrics.push_back(&threadMetrics);
+    threadMetrics.registered = 1;
+    (void)&retireMetrics; // constructed now, so its destructor runs at exit
+}
+RetireMetrics::~RetireMetrics() {
+    if (!threadMetrics.registered)
+        return;
+    lock_guard<mutex> guard(metricsLock);
+    for (int m = 0; m < NUM_METRICS; m++)
+        retiredMetrics.v[m] += threadMetrics.v[m].load(memory_order_relaxed);
+    liveMetrics.erase(find(liveMetrics.begin(), liveMetrics.end(), &threadMetrics));
+}
+
+// only the owning thread writes its block, so no locked add is needed
+inline void addMetric(Metric m, long long n) {
+    atomic<long long> &c = threadMetrics.v[m];
+    c.store(c.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+inline void countMetric(Metric m, long long n) {
+    if (!threadMetrics.registered)
+        registerMetrics();
+    addMetric(m, n);
+}
+// one word scored by a DP engine: its cells and whether it stopped early
+inline void countWord(long long cells, bool earlyExit) {
+    if (!threadMetrics.registered)
+        registerMetrics();
+    addMetric(M_WORDS, 1);
+    addMetric(M_CELLS, cells);
+    addMetric(M_EARLY_EXITS, earlyExit);
+}
+
+Metrics metricsTotal() {
+    lock_guard<mutex> guard(metricsLock);
+    Metrics total = retiredMetrics;
+    for (ThreadMetrics *t: liveMetrics)
+        for (int m = 0; m < NUM_METRICS; m++)
+            total.v[m] += t->v[m].load(memory_order_relaxed);
+    return total;
+}
+
+// adds the wall time of its scope to a phase
+struct PhaseTimer {
+    Metric metric;
+    chrono::steady_clock::time_point start;
+    PhaseTimer(Metric metric): metric(metric), start(chrono::steady_clock::now()) {}
+    ~PhaseTimer() {
+        countMetric(metric, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+    }
+};
+
+#ifdef NOISY_NO_METRICS
+#define COUNT(metric, n) ((void)0)
+#define COUNT_WORD(cells, earlyExit) ((void)0)
+#define PHASE_TIMER(metric) ((void)0)
+#else
+#define COUNT(metric, n) countMetric(metric, n)
+#define COUNT_WORD(cells, earlyExit) countWord(cells, earlyExit)
+#define PHASE_TIMER(metric) PhaseTimer phaseTimer(metric)
+#endif
+
+// count the growth of a scratch buffer that is about to hold n elements
+template <class T>
+void countGrowth(const vector<T> &buffer, size_t n) {
+    if (n > buffer.capacity())
+        COUNT(M_ALLOCATIONS, 1);
+}
+
+void printMetrics(ostream &out, const Metrics &last, const Metrics &total) {
+    out << "Total comparisons during last command: " << last[M_CELLS] << "\n";
+    out << "Total comparisons since beginning of program: " << total[M_CELLS] << "\n";
+    if (last[M_TRIE_FULL_CELLS] > 0) {
+        long long full = last[M_TRIE_FULL_CELLS];
+        long long computed = last[M_TRIE_CELLS];
+        out << "Trie DP cells during last command: " << computed << " of " << full
+            << " (" << 100.0 * (full - computed) / full << "% saved)\n";
+    }
+    if (last[M_BK_SEARCHES] > 0)
+        out << "BK-tree searches during last command: " << last[M_BK_SEARCHES] << ", "
+            << last[M_BK_NODES] << " nodes visited\n";
+    out << "Words during last command: " << last[M_WORDS] << " scored, " << last[M_PRUNED]
+        << " pruned, " << last[M_DUPLICATES] << " duplicates, " << last[M_DISJOINT] << " disjoint, "
+        << last[M_EARLY_EXITS] << " exited early, " << last[M_INDEX_HITS]
+        << " index hits, " << last[M_ALLOCATIONS] << " buffer growths\n";
+    out << fixed << setprecision(3) << "Time during last command (ms): load " << last[M_NS_LOAD] / 1e6
+        << ", filter " << last[M_NS_FILTER] / 1e6 << ", score " << last[M_NS_SCORE] / 1e6
+        << ", output " << last[M_NS_OUTPUT] / 1e6 << "\n";
+    out.unsetf(ios::floatfield);
+    out << setprecision(6);
+}
+
+// -metrics: every counter since the start, as one JSON object
+void dumpMetrics() {
+    if (!opt_metrics)
+        return;
+    ofstream out(opt_metrics);
+    Metrics total = metricsTotal();
+    out << "{";
+    for (int m = 0; m < NUM_METRICS; m++)
+        out << (m ? ", " : "") << "\"" << metricNames[m] << "\": " << total.v[m];
+    out << "}\n";
+}
+
+enum Engine { ENGINE_SUFFIX, ENGINE_SELLERS, ENGINE_BITPAR, ENGINE_SIMD, NUM_ENGINES };
+const char *engineNames[NUM_ENGINES] = {"suffix", "sellers", "bitpar", "simd"};
+Engine opt_engine = ENGINE_BITPAR;
+
+/* DICTIONARY */
+
+// a read-only array: a vector of a dictionary read from text, or a
+// section of a mapped binary dictionary
+template <class T>
+struct ArrayView {
+    const T *ptr = nullptr;
+    size_t n = 0;
+
+    ArrayView() {}
+    ArrayView(const T *ptr, size_t n): ptr(ptr), n(n) {}
+    ArrayView(const vector<T> &v): ptr(v.data()), n(v.size()) {}
+    size_t size() const {
+        return n;
+    }
+    const T &operator[](size_t i) const {
+        return ptr[i];
+    }
+    const T *begin() const {
+        return ptr;
+    }
+    const T *end() const {
+        return ptr + n;
+    }
+};
+
+// bit c % 64 is set for every character c of s, so two strings whose
+// masks do not intersect share no character
+uint64_t charMask(string_view s) {
+    uint64_t mask = 0;
+    for (char c: s)
+        mask |= 1ULL << ((unsigned char)c % 64);
+    return mask;
+}
+
+// every word in one contiguous pool of characters, each followed by '\n'
+// (so the pool doubles as the text of the suffix array index), with an
+// offset/length table and the word ids sorted by length. words are handed
+// out as string_views into the pool and never copied. the arrays are the
+// layout of dictionary/dictformat.h: they view either the vectors filled by
+// add() or a mapped binary dictionary. dedup() then numbers the distinct
+// words, so that the copies of a word are scored once
+struct Dictionary {
+    ArrayView<char> pool;
+    ArrayView<uint32_t> offset;
+    ArrayView<uint32_t> length;
+    ArrayView<uint32_t> byLength;    // stable: equal lengths stay in dictionary order
+    ArrayView<uint32_t> lengthStart; // words of length len start at byLength[lengthStart[len]]
+    ArrayView<uint32_t> wordAt, sa;  // prebuilt suffix array index, if the binary has one
+    vector<uint32_t> uniqueId;    // distinct words numbered in order of first occurrence
+    vector<uint32_t> uniqueFirst; // first word of every unique id
+    vector<uint64_t> uniqueMask;  // charMask of every unique id
+    vector<uint32_t> nextCopy;    // next word with the same text, UINT32_MAX after the last
+    size_t uniqueLength = 0;      // total length of the distinct words
+
+    Dictionary() {}
+    Dictionary(const Dictionary &) = delete;
+    size_t size() const {
+        return offset.size();
+    }
+    string_view operator[](size_t w) const {
+        return string_view(&pool[offset[w]], length[w]);
+    }
+    size_t numUnique() const {
+        return uniqueFirst.size();
+    }
+    // word w is the one of its copies that gets scored
+    bool isFirstCopy(size_t w) const {
+        return uniqueFirst[uniqueId[w]] == w;
+    }
+    void add(string_view word) {
+        offsetData.push_back(poolData.size());
+        lengthData.push_back(word.size());
+        poolData.insert(poolData.end(), word.begin(), word.end());
+        poolData.push_back('\n');
+    }
+    // call once every word is added
+    void finish() {
+        dictSortByLength(lengthData.data(), lengthData.size(), byLengthData, lengthStartData);
+        pool = poolData;
+        offset = offsetData;
+        length = lengthData;
+        byLength = byLengthData;
+        lengthStart = lengthStartData;
+    }
+    // call once the arrays are set, by finish() or by mapping a binary
+    // dictionary. words are lowercased when they are written to the pool,
+    // so case-folded collisions are duplicates too
+    void dedup() {
+        unordered_map<string_view, uint32_t> ids;
+        ids.reserve(size());
+        uniqueId.resize(size());
+        uniqueFirst.clear();
+        uniqueMask.clear();
+        nextCopy.assign(size(), UINT32_MAX);
+        uniqueLength = 0;
+        vector<uint32_t> lastCopy;
+        for (uint32_t w = 0; w < size(); w++) {
+            auto [it, added] = ids.emplace((*this)[w], uniqueFirst.size());
+            if (added) {
+                uniqueFirst.push_back(w);
+                uniqueMask.push_back(charMask((*this)[w]));
+                uniqueLength += length[w];
+                lastCopy.push_back(w);
+            } else
+                nextCopy[lastCopy[it->second]] = w;
+            uniqueId[w] = it->second;
+            lastCopy[it->second] = w;
+        }
+    }
+
+private:
+    vector<char> poolData;
+    vector<uint32_t> offsetData, lengthData, byLengthData, lengthStartData;
+};
+
+// the sections of a mapped dictionary only index each other within bounds:
+// every word (and its '\n') is inside the pool, byLength holds word ids,
+// lengthStart rises to the number of words, and the index points at
+// positions of the pool and the words around them. a corrupt file is
+// rejected at load time rather than read out of bounds later
+bool validSections(const Dictionary &dictionary, const DictHeader &h) {
+    for (size_t w = 0; w < h.numWords; w++)
+        if ((uint64_t)dictionary.offset[w] + dictionary.length[w] >= h.poolSize
+            || dictionary.length[w] > h.maxLength)
+            return 0;
+    for (uint32_t w: dictionary.byLength)
+        if (w >= h.numWords)
+            return 0;
+    for (size_t len = 0; len + 1 < dictionary.lengthStart.size(); len++)
+        if (dictionary.lengthStart[len] > dictionary.lengthStart[len + 1])
+            return 0;
+    if (dictionary.lengthStart[0] != 0 || dictionary.lengthStart[(size_t)h.maxLength + 1] != h.numWords)
+        return 0;
+    for (size_t pos = 0; pos < dictionary.wordAt.size(); pos++) {
+        uint32_t w = dictionary.wordAt[pos];
+        if (w >= h.numWords || pos < dictionary.offset[w] || pos > dictionary.offset[w] + dictionary.length[w])
+            return 0;
+    }
+    for (uint32_t pos: dictionary.sa)
+        if (pos >= h.poolSize)
+            return 0;
+    return 1;
+}
+
+// map path into dictionary if it is a binary dictionary (dictgen -bin).
+// returns 0 for any other file, which is then read as text. the mapping
+// is kept for the lifetime of the program
+bool mapDictionary(const char *path, Dictionary &dictionary) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    DictHeader h;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(h)
+        || pread(fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, DICT_MAGIC, sizeof(h.magic)) != 0) {
+        close(fd);
+        return 0;
+    }
+    DictLayout l = dictLayout(h);
+    if (h.version != DICT_VERSION || (size_t)st.st_size < l.total
+        || (h.saSize != 0 && !(h.flags & DICT_HAS_INDEX))) {
+        cerr << "Unsupported or truncated binary dictionary\n";
+        exit(1);
+    }
+    void *map = mmap(nullptr, l.total, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Failed to map input file\n");
+        exit(1);
+    }
+    const char *base = (const char *)map;
+    auto u32 = [&](size_t pos) {
+        return (const uint32_t *)(base + pos);
+    };
+    dictionary.pool = ArrayView<char>(base + l.pool, h.poolSize);
+    dictionary.offset = ArrayView<uint32_t>(u32(l.offset), h.numWords);
+    dictionary.length = ArrayView<uint32_t>(u32(l.length), h.numWords);
+    dictionary.byLength = ArrayView<uint32_t>(u32(l.byLength), h.numWords);
+    dictionary.lengthStart = ArrayView<uint32_t>(u32(l.lengthStart), (size_t)h.maxLength + 2);
+    if (h.flags & DICT_HAS_INDEX) {
+        dictionary.wordAt = ArrayView<uint32_t>(u32(l.wordAt), h.poolSize);
+        dictionary.sa = ArrayView<uint32_t>(u32(l.sa), h.saSize);
+    }
+    if (!validSections(dictionary, h)) {
+        cerr << "Unsupported or truncated binary dictionary\n";
+        exit(1);
+    }
+    return 1;
+}
+
+// read a text or binary dictionary (exits if path cannot be opened)
+void loadDictionary(const char *path, Dictionary &dictionary) {
+    if (mapDictionary(path, dictionary)) {
+        dictionary.dedup();
+        return;
+    }
+    ifstream in_file;
+    in_file.open(path);
+    if (in_file.fail()) {
+        perror("Failed to open input file\n");
+        exit(1);
+    }
+    for (string x; in_file >> x;) {
+        transform(x.begin(), x.end(), x.begin(), ::tolower);
+        dictionary.add(x);
+    }
+    in_file.close();
+    dictionary.finish();
+    dictionary.dedup();
+}
+
+// an (n+1) x (m+1) Wagner-Fischer matrix in a per-thread scratch buffer
+// that is reused across words, indexed p[i][j]. only -wf prints the whole
+// matrix; every other pass reads nothing but the row before the current
+// one, so it gets two rows of a contiguous buffer instead, and p[i] is row
+// i % 2 of them. the memory of a word is then O(|y|) however long it is
+struct WFMatrix {
+    int *cells;
+    size_t width;
+    size_t rowMask; // ~0 for the whole matrix, 1 for two rows
+    int *operator[](size_t i) const {
+        return cells + (i & rowMask) * width;
+    }
+};
+thread_local vector<int> wfScratch;
+
+WFMatrix scratchCells(size_t rows, size_t m, size_t rowMask) {
+    if (wfScratch.size() < rows * (m + 1)) {
+        countGrowth(wfScratch, rows * (m + 1));
+        wfScratch.resize(rows * (m + 1));
+    }
+    return {wfScratch.data(), m + 1, rowMask};
+}
+
+// the whole matrix with -wf, two rows otherwise
+WFMatrix scratchMatrix(size_t n, size_t m) {
+    if (opt_wf)
+        return scratchCells(n + 1, m, ~(size_t)0);
+    return scratchCells(2, m, 1);
+}
+
+/* COST MODELS (-cost) */
+
+// unit costs, which the bit-parallel, simd and trie kernels assume
+constexpr int d_subst(char a, char b) {
+    if (a == b)
+        return 0;
+    return 1;
+}
+
+constexpr int d_insrt() {
+    return 1;
+}
+
+constexpr int d_delet() {
+    return 1;
+}
+
+// the cost-model policies of the Wagner-Fischer engines: subst(a, b) reads
+// character a of x as b of y, insrt(c) inserts c of y and delet(c) deletes
+// c of x. minInsrt is the cheapest insertion, for the cut of sellers
+struct UnitCost {
+    static constexpr bool UNIT = true;
+    constexpr int subst(char a, char b) const {
+        return d_subst(a, b);
+    }
+    constexpr int insrt(char) const {
+        return d_insrt();
+    }
+    constexpr int delet(char) const {
+        return d_delet();
+    }
+    constexpr int minInsrt() const {
+        return d_insrt();
+    }
+};
+
+// costs of -cost, from 0 to 255, looked up in a row of sub per character
+// of x. the lower bounds (-b, -idx) are scaled by the cheapest operation
+// they count, which is 0 (no pruning) if that operation can be free
+struct WeightedCost {
+    static constexpr bool UNIT = false;
+    uint8_t sub[256][256];
+    uint8_t ins[256];
+    uint8_t del[256];
+    int minIns;
+    int minUnmatched; // cheapest way to produce a character of y from another one of x
+    int minEdit;      // cheapest insertion, deletion or substitution
+
+    int subst(char a, char b) const {
+        return sub[(unsigned char)a][(unsigned char)b];
+    }
+    int insrt(char c) const {
+        return ins[(unsigned char)c];
+    }
+    int delet(char c) const {
+        return del[(unsigned char)c];
+    }
+    int minInsrt() const {
+        return minIns;
+    }
+};
+WeightedCost weightedCost;
+// the model of -cost, or nullptr for unit costs
+const WeightedCost *costModel = nullptr;
+
+// read a cost file: unit costs, changed by one rule per line (later rules
+// win, # starts a comment):
+//  sub [from] [to] [cost]: every character of from read as one of to
+//  ins [chars] [cost], del [chars] [cost]
+// where * stands for every character. a character read as itself is free
+void loadCostModel(const char *path, WeightedCost &cost) {
+    ifstream in_file(path);
+    if (in_file.fail()) {
+        perror("Failed to open cost file\n");
+        exit(1);
+    }
+    for (int a = 0; a < 256; a++) {
+        for (int b = 0; b < 256; b++)
+            cost.sub[a][b] = d_subst(a, b);
+        cost.ins[a] = d_insrt();
+        cost.del[a] = d_delet();
+    }
+    auto chars = [](const string &set) {
+        if (set != "*")
+            return set;
+        string all;
+        for (int c = 0; c < 256; c++)
+            all.push_back(c);
+        return all;
+    };
+    int lineNum = 0;
+    for (string line; getline(in_file, line);) {
+        lineNum++;
+        istringstream iss(line.substr(0, line.find('#')));
+        vector<string> rule;
+        for (string s; iss >> s;)
+            rule.push_back(s);
+        if (rule.empty())
+            continue;
+        bool isSub = rule[0] == "sub";
+        int c = -1;
+        if ((isSub && rule.size() == 4) || ((rule[0] == "ins" || rule[0] == "del") && rule.size() == 3)) {
+            try {
+                c = stoi(rule.back());
+            } catch (...) {
+            }
+        }
+        if (c < 0 || c > 255) {
+            cerr << path << ":" << lineNum << ": expected sub [from] [to] [cost] or ins|del [chars] [cost],"
+                 << " with a cost from 0 to 255\n";
+            exit(1);
+        }
+        for (unsigned char a: chars(rule[1])) {
+            if (rule[0] == "ins")
+                cost.ins[a] = c;
+            else if (rule[0] == "del")
+                cost.del[a] = c;
+            else
+                for (unsigned char b: chars(rule[2]))
+                    if (a != b)
+                        cost.sub[a][b] = c;
+        }
+    }
+
+    cost.minIns = cost.minUnmatched = cost.minEdit = 255;
+    for (int b = 0; b < 256; b++) {
+        int unmatched = cost.ins[b];
+        for (int a = 0; a < 256; a++)
+            if (a != b)
+                unmatched = min(unmatched, (int)cost.sub[a][b]);
+        cost.minIns = min(cost.minIns, (int)cost.ins[b]);
+        cost.minUnmatched = min(cost.minUnmatched, unmatched);
+        cost.minEdit = min(cost.minEdit, min(unmatched, (int)cost.del[b]));
+    }
+}
+
+// REFERENCE ENGINE (-e suffix)
+// compute Wagner-Fischer for all suffixes of x up to length k,
+// computing the LD between all prefixes of those suffixes and y
+// return the mininum LD of these substrings
+template <class Cost>
+int k_dist_suffix(string_view x, string_view y, size_t k, const Cost &cost) {
+    int cntOuterCharComp = 0;
+    int minDist = INF;
+    size_t n = x.size();
+    size_t m = y.size();
+
+    /* WAGNER-FISCHER */
+
+    // wagner-fischer matrix
+    WFMatrix p = scratchMatrix(n, m);
+
+    for (size_t q = n - k + 1; q <= n; q++) {
+        int cntInnerCharComp = 0;
+        // v takes the values of the suffixes of x
+        string_view v = x.substr(n - q, q);
+
+        // if we were to insert every character of y to get from blank string to y
+        // (again for every suffix, as two rows overwrite it)
+        p[0][0] = 0;
+        for (size_t j = 1; j <= m; j++)
+            p[0][j] = p[0][j - 1] + cost.insrt(y[j - 1]);
+        // the empty substring, which never beats a character of x at unit cost
+        // but can with a cheap enough -cost insertion (as in sellers)
+        minDist = min(minDist, p[0][m]);
+
+        // compute Wagner-Fischer matrix using v and y
+        for (size_t i = 1; i <= q; i++) {
+            // if we were to delete every character of v to get from v to blank string
+            p[i][0] = p[i - 1][0] + cost.delet(v[i - 1]);
+            for (size_t j = 1; j <= m; j++) {
+                cntInnerCharComp++;
+                int r1 = p[i - 1][j - 1] + cost.subst(v[i - 1], y[j - 1]);
+                int r2 = p[i][j - 1] + cost.insrt(y[j - 1]);
+                int r3 = p[i - 1][j] + cost.delet(v[i - 1]);
+                p[i][j] = min(r1, min(r2, r3));
+            }
+            minDist = min(minDist, p[i][m]);
+        }
+        cntOuterCharComp += cntInnerCharComp;
+
+        if (opt_wf) {
+            *wfOut << "\e[0;32;40m    ";
+            for (size_t j = 0; j < m; j++)
+                *wfOut << "  " << y[j];
+            *wfOut << "\n ";
+            for (size_t j = 0; j <= m; j++)
+                *wfOut << "  " << p[0][j];
+            for (size_t i = 0; i < q; i++) {
+                *wfOut << "\n" << v[i];
+                for (size_t j = 0; j < m; j++)
+                    *wfOut << "  " << p[i + 1][j];
+                *wfOut << "  \e[0;30;47m" << p[i + 1][m] << "\e[0;32;40m";
+            }
+            *wfOut << "\n\e[0m  Min = " << minDist << "";
+            if (opt_cnt) {
+                *wfOut << "\nComparisons: " << cntInnerCharComp;
+            }
+            *wfOut << "\n\n";
+        }
+    }
+    COUNT_WORD(cntOuterCharComp, 0);
+    return minDist;
+}
+
+// SELLERS ENGINE (-e sellers)
+// compute the same minimum as k_dist_suffix in a single Wagner-Fischer pass.
+// instead of restarting the matrix for every suffix of x, a substring may
+// start for free at any of the first k rows (a suffix of length >= n-k+1),
+// so row i of the first column holds the cost of deleting x[k-1..i) only
+template <class Cost>
+int k_dist_sellers(string_view x, string_view y, size_t k, int cutoff, const Cost &cost) {
+    int cntInnerCharComp = 0;
+    int minDist = INF;
+    size_t n = x.size();
+    size_t m = y.size();
+
+    /* WAGNER-FISCHER (semi-global) */
+
+    // wagner-fischer matrix
+    WFMatrix p = scratchMatrix(n, m);
+
+    // free start for the first k rows (p[0][0] here, the rest row by row),
+    // then delete every character after the last allowed start
+    p[0][0] = 0;
+
+    // if we were to insert every character of y to get from blank string to y
+    for (size_t j = 1; j <= m; j++)
+        p[0][j] = p[0][j - 1] + cost.insrt(y[j - 1]);
+    // the empty substring (see k_dist_suffix)
+    minDist = p[0][m];
+
+    // with a cutoff, a cell is live if it can still end in a distance <= cutoff:
+    // its value plus the insertions needed when fewer characters of x remain
+    // than of y, at the cheapest insertion cost. each row is only computed up to one past the last live cell
+    // of the previous row (Ukkonen's cut); the cell after that is marked dead
+    bool bounded = cutoff != INF;
+    auto live = [&](size_t i, size_t j) {
+        return p[i][j] + max(0, (int)(m - j) - (int)(n - i)) * cost.minInsrt() <= cutoff;
+    };
+    auto lastLive = [&](size_t i, size_t last) -> int {
+        for (int j = last; j >= 0; j--)
+            if (live(i, j))
+                return j;
+        return -1;
+    };
+    int top = bounded ? lastLive(0, m) : m;
+    [[maybe_unused]] bool earlyExit = 0;
+
+    for (size_t i = 1; i <= n; i++) {
+        p[i][0] = i < k ? 0 : p[i - 1][0] + cost.delet(x[i - 1]);
+        size_t last = min(m, (size_t)(top + 1));
+        for (size_t j = 1; j <= last; j++) {
+            cntInnerCharComp++;
+            int r1 = p[i - 1][j - 1] + cost.subst(x[i - 1], y[j - 1]);
+            int r2 = p[i][j - 1] + cost.insrt(y[j - 1]);
+            int r3 = p[i - 1][j] + cost.delet(x[i - 1]);
+            p[i][j] = min(r1, min(r2, r3));
+        }
+        // unit costs never decrease along a diagonal, so the cell past the
+        // cut is dead. a weighted insertion can be cheaper than that, so the
+        // row goes on to the right (from live cells only) while it is live
+        if constexpr (!Cost::UNIT) {
+            for (; bounded && last < m && live(i, last); last++) {
+                cntInnerCharComp++;
+                p[i][last + 1] = p[i][last] + cost.insrt(y[last]);
+            }
+        }
+        if (last < m)
+            p[i][last + 1] = cutoff + 1;
+        else
+            minDist = min(minDist, p[i][m]);
+        if (bounded) {
+            // a dead first column stays dead, so no later row can come back
+            top = lastLive(i, last);
+            if (top < 0) {
+                earlyExit = i < n;
+                break;
+            }
+        }
+    }
+    if (bounded && minDist > cutoff)
+        minDist = cutoff + 1;
+
+    if (opt_wf) {
+        *wfOut << "\e[0;32;40m    ";
+        for (size_t j = 0; j < m; j++)
+            *wfOut << "  " << y[j];
+        *wfOut << "\n ";
+        for (size_t j = 0; j <= m; j++)
+            *wfOut << "  " << p[0][j];
+        for (size_t i = 0; i < n; i++) {
+            *wfOut << "\n" << x[i];
+            for (size_t j = 0; j < m; j++)
+                *wfOut << "  " << p[i + 1][j];
+            *wfOut << "  \e[0;30;47m" << p[i + 1][m] << "\e[0;32;40m";
+        }
+        *wfOut << "\n\e[0m  Min = " << minDist << "";
+        if (opt_cnt) {
+            *wfOut << "\nComparisons: " << cntInnerCharComp;
+        }
+        *wfOut << "\n\n";
+    }
+    COUNT_WORD(cntInnerCharComp, earlyExit);
+    return minDist;
+}
+
+// BIT-PARALLEL ENGINE (-e bitpar, default)
+// Myers' bit-vector algorithm in its block-based form: y is the pattern,
+// x the text, and each 64-bit block holds the vertical deltas of 64 cells
+// of a column. the top of a column rises by one once the column is past
+// the last free start (k), just like the first column of k_dist_sellers
+
+// peq[c * blocks + b]: bit j of block b is set if y[64b + j] == c
+// rebuilt only when y changes, so one query builds it once
+struct PeqTable {
+    string y;
+    size_t blocks = 0;
+    vector<uint64_t> peq;
+};
+thread_local PeqTable peqCache;
+
+const PeqTable &peqFor(string_view y) {
+    if (peqCache.blocks == 0 || peqCache.y != y) {
+        peqCache.y = y;
+        peqCache.blocks = (y.size() + 63) / 64;
+        countGrowth(peqCache.peq, 256 * peqCache.blocks);
+        peqCache.peq.assign(256 * peqCache.blocks, 0);
+        for (size_t j = 0; j < y.size(); j++)
+            peqCache.peq[(unsigned char)y[j] * peqCache.blocks + j / 64] |= 1ULL << (j % 64);
+    }
+    return peqCache;
+}
+
+// |y| <= 64: the whole column fits in one machine word
+int k_dist_bitpar_word(string_view x, const PeqTable &t, size_t m, size_t k, int cutoff, size_t &rows) {
+    // the empty substring matches an empty y (and it has no highest bit)
+    if (m == 0) {
+        rows = 0;
+        return 0;
+    }
+    int minDist = INF;
+    int score = m;
+    uint64_t high = 1ULL << (m - 1);
+    uint64_t pv = ~0ULL, mv = 0;
+    for (size_t i = 0; i < x.size(); i++) {
+        uint64_t eq = t.peq[(unsigned char)x[i]];
+        uint64_t xv = eq | mv;
+        uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+        uint64_t ph = mv | ~(xh | pv);
+        uint64_t mh = pv & xh;
+        if (ph & high)
+            score++;
+        else if (mh & high)
+            score--;
+        ph = (ph << 1) | (i + 1 >= k);
+        mh <<= 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+        minDist = min(minDist, score);
+        rows = i + 1;
+        if (cutoff != INF && score - (int)(x.size() - i - 1) > min(minDist - 1, cutoff))
+            break;
+    }
+    return minDist;
+}
+
+// |y| > 64: carry the horizontal delta from block to block
+// the block vectors live in per-thread scratch
+thread_local vector<uint64_t> pvScratch, mvScratch;
+
+int k_dist_bitpar_blocks(string_view x, const PeqTable &t, size_t m, size_t k, int cutoff, size_t &rows) {
+    if (m == 0) {
+        rows = 0;
+        return 0;
+    }
+    int minDist = INF;
+    int score = m;
+    size_t blocks = t.blocks;
+    uint64_t lastHigh = 1ULL << ((m - 1) % 64);
+    countGrowth(pvScratch, blocks);
+    pvScratch.assign(blocks, ~0ULL);
+    mvScratch.assign(blocks, 0);
+    uint64_t *pv = pvScratch.data(), *mv = mvScratch.data();
+    for (size_t i = 0; i < x.size(); i++) {
+        const uint64_t *peq = &t.peq[(unsigned char)x[i] * blocks];
+        int h = (i + 1 >= k);
+        for (size_t b = 0; b < blocks; b++) {
+            uint64_t eq = peq[b];
+            uint64_t xv = eq | mv[b];
+            if (h < 0)
+                eq |= 1;
+            uint64_t xh = (((eq & pv[b]) + pv[b]) ^ pv[b]) | eq;
+            uint64_t ph = mv[b] | ~(xh | pv[b]);
+            uint64_t mh = pv[b] & xh;
+            uint64_t high = (b == blocks - 1) ? lastHigh : 1ULL << 63;
+            int hout = (ph & high) ? 1 : (mh & high) ? -1 : 0;
+            ph <<= 1;
+            mh <<= 1;
+            if (h < 0)
+                mh |= 1;
+            else if (h > 0)
+                ph |= 1;
+            pv[b] = mh | ~(xv | ph);
+            mv[b] = ph & xv;
+            h = hout;
+        }
+        score += h;
+        minDist = min(minDist, score);
+        rows = i + 1;
+        if (cutoff != INF && score - (int)(x.size() - i - 1) > min(minDist - 1, cutoff))
+            break;
+    }
+    return minDist;
+}
+
+// with a cutoff, stop once the score at the end of y, which changes by at
+// most one per character of x, can no longer drop to the cutoff
+int k_dist_bitpar(string_view x, string_view y, size_t k, int cutoff) {
+    const PeqTable &t = peqFor(y);
+    size_t m = y.size();
+    size_t rows = 0;
+    int minDist;
+    if (t.blocks == 1)
+        minDist = k_dist_bitpar_word(x, t, m, k, cutoff, rows);
+    else
+        minDist = k_dist_bitpar_blocks(x, t, m, k, cutoff, rows);
+    COUNT_WORD(rows * m, rows < x.size());
+    if (minDist > cutoff)
+        minDist = cutoff + 1;
+    return minDist;
+}
+
+// SIMD ENGINE (-e simd)
+// inter-sequence striping: y is scored against a batch of words at once,
+// one word per 16-bit lane (16 lanes with AVX2, 8 with SSE4.1). the rows
+// of all lanes are computed together with saturating arithmetic; every lane
+// uses the k of its own word for the first column and only takes the
+// minimum over the rows of its own word. the instruction set is picked by
+// CPU feature detection at startup, and without SSE4.1 (or on other
+// architectures) words are scored one by one with bitpar
+
+enum SimdLevel { SIMD_SCALAR, SIMD_SSE41, SIMD_AVX2, NUM_SIMD_LEVELS };
+const char *simdNames[NUM_SIMD_LEVELS] = {"scalar", "sse4.1", "avx2"};
+SimdLevel simdLevel = SIMD_SCALAR;
+
+SimdLevel simdDetect() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return SIMD_SSE41;
+#endif
+    return SIMD_SCALAR;
+}
+
+const int SIMD_MAX_LANES = 16;
+// longest word or query the 16-bit lanes can score without saturating
+const size_t SIMD_MAX_LEN = 0xFFFE;
+
+// one batch: the word id, the word, its length and k - 1 of every lane
+struct SimdBatch {
+    int lanes = 0;
+    size_t maxLen = 0;
+    uint32_t id[SIMD_MAX_LANES];
+    string_view x[SIMD_MAX_LANES];
+    alignas(32) uint16_t n[SIMD_MAX_LANES];
+    alignas(32) uint16_t k1[SIMD_MAX_LANES];
+
+    void add(uint32_t wordId, string_view word, size_t k) {
+        id[lanes] = wordId;
+        x[lanes] = word;
+        n[lanes] = word.size();
+        k1[lanes] = k - 1;
+        maxLen = max(maxLen, word.size());
+        lanes++;
+    }
+};
+
+// two rows of (|y| + 1) cells of SIMD_MAX_LANES lanes
+thread_local vector<uint16_t> simdRows;
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+void k_dist_simd_avx2(SimdBatch &b, string_view y, int *out) {
+    size_t m = y.size();
+    countGrowth(simdRows, 2 * (m + 1) * 16);
+    simdRows.resize(2 * (m + 1) * 16);
+    __m256i *prev = (__m256i *)&simdRows[0];
+    __m256i *cur = prev + (m + 1);
+    for (int l = b.lanes; l < 16; l++)
+        b.n[l] = b.k1[l] = 0;
+    __m256i n = _mm256_load_si256((__m256i *)b.n);
+    __m256i k1 = _mm256_load_si256((__m256i *)b.k1);
+    __m256i one = _mm256_set1_epi16(1);
+    __m256i ones = _mm256_set1_epi16(-1);
+    __m256i best = ones;
+    alignas(32) uint16_t chars[16] = {0};
+
+    for (size_t j = 0; j <= m; j++)
+        _mm256_storeu_si256(prev + j, _mm256_set1_epi16(j * d_insrt()));
+    for (size_t i = 1; i <= b.maxLen; i++) {
+        for (int l = 0; l < b.lanes; l++)
+            chars[l] = (i <= b.n[l]) ? (unsigned char)b.x[l][i - 1] : 0;
+        __m256i xc = _mm256_load_si256((__m256i *)chars);
+        // first column: deletions after the last free start of each lane
+        __m256i left = _mm256_subs_epu16(_mm256_set1_epi16(i), k1);
+        __m256i diag = _mm256_loadu_si256(prev);
+        _mm256_storeu_si256(cur, left);
+        for (size_t j = 1; j <= m; j++) {
+            __m256i up = _mm256_loadu_si256(prev + j);
+            __m256i eq = _mm256_cmpeq_epi16(xc, _mm256_set1_epi16((unsigned char)y[j - 1]));
+            __m256i r1 = _mm256_adds_epu16(diag, _mm256_andnot_si256(eq, one));
+            __m256i r2 = _mm256_adds_epu16(left, one);
+            __m256i r3 = _mm256_adds_epu16(up, one);
+            left = _mm256_min_epu16(r1, _mm256_min_epu16(r2, r3));
+            _mm256_storeu_si256(cur + j, left);
+            diag = up;
+        }
+        // only lanes whose word has at least i characters take the minimum
+        // (n >= i unsigned, as lengths up to SIMD_MAX_LEN overflow int16)
+        __m256i active = _mm256_cmpeq_epi16(_mm256_max_epu16(n, _mm256_set1_epi16(i)), n);
+        best = _mm256_min_epu16(best, _mm256_or_si256(left, _mm256_xor_si256(active, ones)));
+        swap(prev, cur);
+    }
+    _mm256_store_si256((__m256i *)chars, best);
+    for (int l = 0; l < b.lanes; l++)
+        out[l] = chars[l];
+}
+
+__attribute__((target("sse4.1")))
+void k_dist_simd_sse41(SimdBatch &b, string_view y, int *out) {
+    size_t m = y.size();
+    countGrowth(simdRows, 2 * (m + 1) * 8);
+    simdRows.resize(2 * (m + 1) * 8);
+    __m128i *prev = (__m128i *)&simdRows[0];
+    __m128i *cur = prev + (m + 1);
+    for (int l = b.lanes; l < 8; l++)
+        b.n[l] = b.k1[l] = 0;
+    __m128i n = _mm_load_si128((__m128i *)b.n);
+    __m128i k1 = _mm_load_si128((__m128i *)b.k1);
+    __m128i one = _mm_set1_epi16(1);
+    __m128i ones = _mm_set1_epi16(-1);
+    __m128i best = ones;
+    alignas(16) uint16_t chars[8] = {0};
+
+    for (size_t j = 0; j <= m; j++)
+        _mm_storeu_si128(prev + j, _mm_set1_epi16(j * d_insrt()));
+    for (size_t i = 1; i <= b.maxLen; i++) {
+        for (int l = 0; l < b.lanes; l++)
+            chars[l] = (i <= b.n[l]) ? (unsigned char)b.x[l][i - 1] : 0;
+        __m128i xc = _mm_load_si128((__m128i *)chars);
+        // first column: deletions after the last free start of each lane
+        __m128i left = _mm_subs_epu16(_mm_set1_epi16(i), k1);
+        __m128i diag = _mm_loadu_si128(prev);
+        _mm_storeu_si128(cur, left);
+        for (size_t j = 1; j <= m; j++) {
+            __m128i up = _mm_loadu_si128(prev + j);
+            __m128i eq = _mm_cmpeq_epi16(xc, _mm_set1_epi16((unsigned char)y[j - 1]));
+            __m128i r1 = _mm_adds_epu16(diag, _mm_andnot_si128(eq, one));
+            __m128i r2 = _mm_adds_epu16(left, one);
+            __m128i r3 = _mm_adds_epu16(up, one);
+            left = _mm_min_epu16(r1, _mm_min_epu16(r2, r3));
+            _mm_storeu_si128(cur + j, left);
+            diag = up;
+        }
+        // only lanes whose word has at least i characters take the minimum
+        // (n >= i unsigned, as lengths up to SIMD_MAX_LEN overflow int16)
+        __m128i active = _mm_cmpeq_epi16(_mm_max_epu16(n, _mm_set1_epi16(i)), n);
+        best = _mm_min_epu16(best, _mm_or_si128(left, _mm_xor_si128(active, ones)));
+        swap(prev, cur);
+    }
+    _mm_store_si128((__m128i *)chars, best);
+    for (int l = 0; l < b.lanes; l++)
+        out[l] = chars[l];
+}
+#endif
+
+int simdLanes(SimdLevel level) {
+    return level == SIMD_AVX2 ? 16 : level == SIMD_SSE41 ? 8 : 1;
+}
+
+// score a batch of at most simdLanes(level) words
+void k_dist_simd_batch(SimdLevel level, SimdBatch &b, string_view y, int *out) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (level == SIMD_AVX2 || level == SIMD_SSE41) {
+        long long cells = 0;
+        for (int l = 0; l < b.lanes; l++)
+            cells += b.n[l] * y.size();
+        COUNT(M_CELLS, cells);
+        COUNT(M_WORDS, b.lanes);
+        if (level == SIMD_AVX2)
+            return k_dist_simd_avx2(b, y, out);
+        return k_dist_simd_sse41(b, y, out);
+    }
+#endif
+    for (int l = 0; l < b.lanes; l++)
+        out[l] = k_dist_bitpar(b.x[l], y, b.k1[l] + 1, INF);
+}
+
+int k_dist_simd(string_view x, string_view y, size_t k) {
+    if (x.size() > SIMD_MAX_LEN || y.size() > SIMD_MAX_LEN)
+        return k_dist_bitpar(x, y, k, INF);
+    SimdBatch b;
+    b.add(0, x, k);
+    int dist;
+    k_dist_simd_batch(simdLevel, b, y, &dist);
+    return dist;
+}
+
+// with a cutoff, return the exact distance if it is <= cutoff and some
+// value > cutoff otherwise (the reference engine always returns the exact one).
+// a -cost model is only supported by the generic Wagner-Fischer engines, so
+// bitpar and simd fall back to sellers with it
+int k_dist(string_view x, string_view y, size_t k, int cutoff = INF) {
+    if (costModel) {
+        if (opt_engine == ENGINE_SUFFIX)
+            return k_dist_suffix(x, y, k, *costModel);
+        return k_dist_sellers(x, y, k, cutoff, *costModel);
+    }
+    switch (opt_engine) {
+    case ENGINE_SUFFIX:
+        return k_dist_suffix(x, y, k, UnitCost());
+    case ENGINE_SELLERS:
+        return k_dist_sellers(x, y, k, cutoff, UnitCost());
+    case ENGINE_SIMD:
+        if (opt_wf)
+            return k_dist_sellers(x, y, k, cutoff, UnitCost());
+        return k_dist_simd(x, y, k);
+    case ENGINE_BITPAR:
+    default:
+        // the bit vectors never hold the matrix, so -wf needs sellers
+        if (opt_wf)
+            return k_dist_sellers(x, y, k, cutoff, UnitCost());
+        return k_dist_bitpar(x, y, k, cutoff);
+    }
+}
+
+// k = x.size() with default algorithm, or max(1, |x|-|y|+1) with optimized version
+size_t chooseK(string_view x, string_view y) {
+    if (opt_o)
+        return max((int)x.size() - (int)y.size() + 1, 1);
+    return x.size();
+}
+
+/* ALIGNMENT (-align) */
+
+// where the best substring of x sits and how it is edited into y. the
+// script is run-length encoded, with = for a match, X for a substitution,
+// I for a character of y inserted and D for a character of x deleted
+struct Alignment {
+    int dist;
+    size_t start, end; // the substring x[start, end)
+    string script;
+};
+
+// the last row of the global Wagner-Fischer matrix of a against b, into
+// row (|b| + 1 cells, with tmp as the other row). with Reverse, both
+// strings are read backwards, so row[j] is the distance of the suffixes
+template <bool Reverse, class Cost>
+void globalLastRow(string_view a, string_view b, int *row, int *tmp, const Cost &cost) {
+    auto at = [](string_view s, size_t i) {
+        return Reverse ? s[s.size() - 1 - i] : s[i];
+    };
+    size_t m = b.size();
+    int *prev = tmp, *cur = row;
+    prev[0] = 0;
+    for (size_t j = 1; j <= m; j++)
+        prev[j] = prev[j - 1] + cost.insrt(at(b, j - 1));
+    for (size_t i = 1; i <= a.size(); i++) {
+        char c = at(a, i - 1);
+        cur[0] = prev[0] + cost.delet(c);
+        for (size_t j = 1; j <= m; j++) {
+            int r1 = prev[j - 1] + cost.subst(c, at(b, j - 1));
+            int r2 = cur[j - 1] + cost.insrt(at(b, j - 1));
+            int r3 = prev[j] + cost.delet(c);
+            cur[j] = min(r1, min(r2, r3));
+        }
+        swap(prev, cur);
+    }
+    if (prev != row)
+        copy(prev, prev + m + 1, row);
+    COUNT(M_CELLS, (long long)a.size() * m);
+}
+
+// Hirschberg's algorithm: the edit operations of a into b, appended to ops
+// one per character, in O(|b|) space. the middle row of a is split at the
+// column where the distance of the prefixes and that of the suffixes add
+// up to the least, and both halves are aligned on their own
+template <class Cost>
+void hirschberg(string_view a, string_view b, string &ops, const Cost &cost) {
+    if (a.empty()) {
+        ops.append(b.size(), 'I');
+        return;
+    }
+    if (b.empty()) {
+        ops.append(a.size(), 'D');
+        return;
+    }
+    size_t m = b.size();
+    if (a.size() == 1) {
+        // a[0] is deleted, or read as the b[j] for which that costs least
+        int insertAll = 0;
+        for (char c: b)
+            insertAll += cost.insrt(c);
+        int best = insertAll + cost.delet(a[0]);
+        size_t bestJ = m;
+        for (size_t j = 0; j < m; j++) {
+            int d = insertAll - cost.insrt(b[j]) + cost.subst(a[0], b[j]);
+            if (d < best) {
+                best = d;
+                bestJ = j;
+            }
+        }
+        if (bestJ == m) {
+            ops += 'D';
+            ops.append(m, 'I');
+        } else {
+            ops.append(bestJ, 'I');
+            ops += a[0] == b[bestJ] ? '=' : 'X';
+            ops.append(m - bestJ - 1, 'I');
+        }
+        return;
+    }
+    size_t mid = a.size() / 2;
+    vector<int> front(m + 1), back(m + 1), tmp(m + 1);
+    globalLastRow<false>(a.substr(0, mid), b, front.data(), tmp.data(), cost);
+    globalLastRow<true>(a.substr(mid), b, back.data(), tmp.data(), cost);
+    size_t split = 0;
+    for (size_t j = 1; j <= m; j++)
+        if (front[j] + back[m - j] < front[split] + back[m - split])
+            split = j;
+    hirschberg(a.substr(0, mid), b.substr(0, split), ops, cost);
+    hirschberg(a.substr(mid), b.substr(split), ops, cost);
+}
+
+// the best substring of x (with a start among the first k characters, as
+// in k_dist; whole: all of x, as with -word) and its edit script, in
+// O(|y|) space. a forward pass of two rows finds the distance and the
+// first row it is reached at (the end), a backward pass from the end finds
+// the start closest to it, and Hirschberg's algorithm aligns the two
+template <class Cost>
+Alignment alignWord(string_view x, string_view y, size_t k, bool whole, const Cost &cost) {
+    size_t n = x.size();
+    size_t m = y.size();
+    vector<int> rows(2 * (m + 1));
+    int *prev = rows.data(), *cur = prev + m + 1;
+    Alignment a;
+    if (whole) {
+        globalLastRow<false>(x, y, prev, cur, cost);
+        a = {prev[m], 0, n, ""};
+    } else {
+        prev[0] = 0;
+        for (size_t j = 1; j <= m; j++)
+            prev[j] = prev[j - 1] + cost.insrt(y[j - 1]);
+        a = {prev[m], 0, 0, ""};
+        for (size_t i = 1; i <= n; i++) {
+            cur[0] = i < k ? 0 : prev[0] + cost.delet(x[i - 1]);
+            for (size_t j = 1; j <= m; j++) {
+                int r1 = prev[j - 1] + cost.subst(x[i - 1], y[j - 1]);
+                int r2 = cur[j - 1] + cost.insrt(y[j - 1]);
+                int r3 = prev[j] + cost.delet(x[i - 1]);
+                cur[j] = min(r1, min(r2, r3));
+            }
+            // a character rather than the empty substring on a tie
+            if (cur[m] < a.dist || (a.end == 0 && cur[m] == a.dist))
+                a = {cur[m], 0, i, ""};
+            swap(prev, cur);
+        }
+        COUNT(M_CELLS, (long long)n * m);
+        // backwards from the end, row r is the substring x[end - r, end) and
+        // its last column the distance of that to y
+        string_view head = x.substr(0, a.end);
+        size_t firstRow = a.end >= k ? a.end - k + 1 : 0;
+        prev[0] = 0;
+        for (size_t j = 1; j <= m; j++)
+            prev[j] = prev[j - 1] + cost.insrt(y[m - j]);
+        for (size_t r = 0; r <= a.end; r++) {
+            if (r > 0) {
+                char c = head[a.end - r];
+                cur[0] = prev[0] + cost.delet(c);
+                for (size_t j = 1; j <= m; j++) {
+                    int r1 = prev[j - 1] + cost.subst(c, y[m - j]);
+                    int r2 = cur[j - 1] + cost.insrt(y[m - j]);
+                    int r3 = prev[j] + cost.delet(c);
+                    cur[j] = min(r1, min(r2, r3));
+                }
+                swap(prev, cur);
+            }
+            if (r >= firstRow && prev[m] == a.dist) {
+                a.start = a.end - r;
+                break;
+            }
+        }
+        COUNT(M_CELLS, (long long)(a.end - a.start) * m);
+    }
+
+    string ops;
+    hirschberg(x.substr(a.start, a.end - a.start), y, ops, cost);
+    for (size_t i = 0; i < ops.size();) {
+        size_t run = 1;
+        while (i + run < ops.size() && ops[i + run] == ops[i])
+            run++;
+        a.script += to_string(run) + ops[i];
+        i += run;
+    }
+    return a;
+}
+
+// the alignment of x to y with the k of chooseK, and the cost model and
+// scoring (substring or -word) of the other commands
+Alignment alignWord(string_view x, string_view y) {
+    size_t k = chooseK(x, y);
+    if (costModel)
+        return alignWord(x, y, k, opt_word, *costModel);
+    return alignWord(x, y, k, opt_word, UnitCost());
+}
+
+// the cost of an edit script applied to x[start, end), or -1 if it does not
+// turn that substring into y (for -v)
+template <class Cost>
+int scriptCost(string_view x, string_view y, const Alignment &a, const Cost &cost) {
+    string_view v = x.substr(a.start, a.end - a.start);
+    size_t i = 0, j = 0;
+    int total = 0;
+    istringstream iss(a.script);
+    size_t run;
+    char op;
+    while (iss >> run >> op) {
+        for (; run > 0; run--) {
+            if (op == 'I' && j < y.size())
+                total += cost.insrt(y[j++]);
+            else if (op == 'D' && i < v.size())
+                total += cost.delet(v[i++]);
+            else if ((op == '=' || op == 'X') && i < v.size() && j < y.size() && (op == '=') == (v[i] == y[j])) {
+                total += cost.subst(v[i], y[j]);
+                i++;
+                j++;
+            } else
+                return -1;
+        }
+    }
+    return i == v.size() && j == y.size() ? total : -1;
+}
+
+// -b: score every word with the best distance found so far as its cutoff
+// (see k_dist), and skip words whose histogram bound already exceeds it
+// (see histogramFilters).
+// a pruned word gets a distance above the final minimum rather than its
+// exact distance, so -t, which prints every distance, and -wf score in full
+bool boundedMode() {
+    return opt_b && !opt_t && !opt_wf;
+}
+
+// characters of y which no character of x can match each cost an insertion
+// or a substitution, so their number bounds the distance of every substring
+// of x from below (times the cheapest such operation with -cost). the counts
+// of y are cached per thread like the peq table
+struct HistTable {
+    string y;
+    bool valid = 0;
+    string distinct;
+    int count[256];
+    int need[256];
+};
+thread_local HistTable histCache;
+
+int histogramBound(string_view x, string_view y) {
+    HistTable &t = histCache;
+    if (!t.valid || t.y != y) {
+        t.y = y;
+        t.valid = 1;
+        t.distinct.clear();
+        memset(t.count, 0, sizeof(t.count));
+        for (char c: y)
+            if (t.count[(unsigned char)c]++ == 0)
+                t.distinct.push_back(c);
+        memcpy(t.need, t.count, sizeof(t.count));
+    }
+    int matched = 0;
+    for (char c: x) {
+        if (t.need[(unsigned char)c] > 0) {
+            t.need[(unsigned char)c]--;
+            matched++;
+        }
+    }
+    for (char c: t.distinct)
+        t.need[(unsigned char)c] = t.count[(unsigned char)c];
+    if (costModel)
+        return (y.size() - matched) * costModel->minUnmatched;
+    return y.size() - matched;
+}
+
+// the bound is a pass over x, which costs as much as bitpar scoring a y of
+// up to 64 characters, so it only filters words for the engines that cost
+// more per word: sellers, suffix, simd one word at a time, -cost (which
+// bitpar falls back to sellers for) and the block kernel of a longer y
+bool histogramFilters(string_view y) {
+    return costModel || opt_engine != ENGINE_BITPAR || y.size() > 64;
+}
+
+int boundedDist(string_view x, string_view y, int cutoff) {
+    if (histogramFilters(y) && histogramBound(x, y) > cutoff) {
+        COUNT(M_PRUNED, 1);
+        return cutoff + 1;
+    }
+    return k_dist(x, y, chooseK(x, y), cutoff);
+}
+
+/* DUPLICATES AND DISJOINT WORDS */
+
+// the copies of a word are only scored through their first copy (see
+// Dictionary::dedup), and get its distance at the end of computeDistances.
+// -wf prints the matrix of every word, so it scores every copy instead
+bool scoresWord(const Dictionary &dictionary, size_t w) {
+    return opt_wf || dictionary.isFirstCopy(w);
+}
+
+void expandDuplicates(const Dictionary &dictionary, vector<int> &distances) {
+    if (opt_wf || dictionary.numUnique() == dictionary.size())
+        return;
+    for (size_t w = 0; w < dictionary.size(); w++)
+        if (!dictionary.isFirstCopy(w))
+            distances[w] = distances[dictionary.uniqueFirst[dictionary.uniqueId[w]]];
+    COUNT(M_DUPLICATES, dictionary.size() - dictionary.numUnique());
+}
+
+// a word sharing no character with y is at distance |y| for every engine
+// and k: every character of y costs an insertion or a substitution, and the
+// empty substring costs exactly that. weighted costs differ from character
+// to character and -word scores the whole word, so the mask of y is 0 (no
+// word is disjoint) with them, and with -wf, which prints every matrix
+uint64_t disjointMask(string_view y) {
+    if (costModel || opt_word || opt_wf)
+        return 0;
+    return charMask(y);
+}
+
+bool disjointWord(const Dictionary &dictionary, uint32_t id, uint64_t yMask) {
+    if (yMask == 0 || (dictionary.uniqueMask[dictionary.uniqueId[id]] & yMask) != 0)
+        return 0;
+    COUNT(M_DISJOINT, 1);
+    return 1;
+}
+
+/* SUFFIX ARRAY INDEX (-idx) */
+
+// the start of every suffix of every word in the dictionary pool, sorted
+// by the suffix up to the end of its word. built once at load time, or
+// taken from a binary dictionary that stores it
+struct DictIndex {
+    bool built = 0;
+    const Dictionary *dict = nullptr;
+    ArrayView<uint32_t> wordAt; // word of every pool offset
+    ArrayView<uint32_t> sa;
+    vector<uint32_t> wordAtData, saData;
+};
+DictIndex dictIndex;
+
+string_view indexSuffix(uint32_t pos) {
+    const Dictionary &dict = *dictIndex.dict;
+    uint32_t w = dictIndex.wordAt[pos];
+    return string_view(&dict.pool[pos], dict.offset[w] + dict.length[w] - pos);
+}
+
+void buildIndex(const Dictionary &dictionary) {
+    DictIndex &idx = dictIndex;
+    idx.dict = &dictionary;
+    if (dictionary.sa.size() > 0) {
+        idx.wordAt = dictionary.wordAt;
+        idx.sa = dictionary.sa;
+    } else {
+        dictBuildIndex(dictionary.pool.begin(), dictionary.pool.size(), dictionary.offset.begin(),
+                       dictionary.length.begin(), dictionary.size(), idx.wordAtData, idx.saData);
+        idx.wordAt = idx.wordAtData;
+        idx.sa = idx.saData;
+    }
+    idx.built = 1;
+}
+
+// range [first, second) of the suffix array whose suffixes begin with str
+pair<size_t, size_t> indexRange(string_view str) {
+    const ArrayView<uint32_t> &sa = dictIndex.sa;
+    auto first = partition_point(sa.begin(), sa.end(), [&](uint32_t pos) {
+        return indexSuffix(pos).substr(0, str.size()) < str;
+    });
+    auto last = partition_point(first, sa.end(), [&](uint32_t pos) {
+        return indexSuffix(pos).substr(0, str.size()) == str;
+    });
+    return {first - sa.begin(), last - sa.begin()};
+}
+
+// q-gram lemma: a substring of x within distance d of y still contains at
+// least (|y| - q + 1) - q*d of the q-grams of y, as one edit destroys at most
+// q of them. so the number of q-gram positions of y occurring in x bounds
+// the distance of x from below (in edits, each costing at least minEdit
+// with -cost). only words sharing a q-gram with y are visited; every other
+// word gets the bound for no shared q-gram
+const size_t QGRAM = 3;
+thread_local vector<int> lastGramScratch;
+
+void qgramBounds(string_view y, size_t numWords, vector<int> &bound) {
+    countGrowth(bound, numWords);
+    bound.assign(numWords, 0);
+    if (y.size() < QGRAM)
+        return;
+    int grams = y.size() - QGRAM + 1;
+    vector<int> &lastGram = lastGramScratch;
+    countGrowth(lastGram, numWords);
+    lastGram.assign(numWords, -1);
+    for (int g = 0; g < grams; g++) {
+        pair<size_t, size_t> range = indexRange(y.substr(g, QGRAM));
+        COUNT(M_INDEX_HITS, range.second - range.first);
+        for (size_t r = range.first; r < range.second; r++) {
+            uint32_t w = dictIndex.wordAt[dictIndex.sa[r]];
+            if (lastGram[w] != g) {
+                lastGram[w] = g;
+                bound[w]++;
+            }
+        }
+    }
+    int editCost = costModel ? costModel->minEdit : 1;
+    for (int &h: bound)
+        h = (grams - h + QGRAM - 1) / QGRAM * editCost;
+}
+
+// word ids ordered by their lower bound (stable), so bounded scoring sees
+// the most promising words first and can stop at the first bound above
+// the cutoff
+thread_local vector<size_t> boundStartScratch;
+
+void boundOrder(const vector<int> &bound, vector<uint32_t> &order) {
+    int maxBound = 0;
+    for (int b: bound)
+        maxBound = max(maxBound, b);
+    vector<size_t> &start = boundStartScratch;
+    start.assign(maxBound + 2, 0);
+    for (int b: bound)
+        start[b + 1]++;
+    for (int b = 0; b <= maxBound; b++)
+        start[b + 1] += start[b];
+    countGrowth(order, bound.size());
+    order.resize(bound.size());
+    for (size_t w = 0; w < bound.size(); w++)
+        order[start[bound[w]]++] = w;
+}
+
+// the threads of runWorkStealing. they are started by the first run that
+// needs them (more are added if a later run asks for more) and sleep between
+// runs, so a query, a -ta keystroke or a -serve cache miss starts no thread.
+// one run uses the pool at a time; a run started by a task of another run
+// executes inline on its thread
+struct WorkPool {
+    mutex runLock; // held for a whole run
+    mutex lock;
+    condition_variable wake, done;
+    vector<thread> threads; // threads[i] is worker i + 1
+    function<void(int)> job;
+    int jobThreads = 0; // workers 1 .. jobThreads - 1 take part in the job
+    int running = 0;    // of them, the ones not finished yet
+    uint64_t generation = 0;
+    bool stop = 0;
+
+    static thread_local bool inRun;
+
+    ~WorkPool() {
+        {
+            lock_guard<mutex> guard(lock);
+            stop = 1;
+        }
+        wake.notify_all();
+        for (thread &th: threads)
+            th.join();
+    }
+
+    void work(int w) {
+        inRun = 1;
+        uint64_t seen = 0;
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [&] { return stop || generation != seen; });
+            if (stop)
+                return;
+            seen = generation;
+            if (w >= jobThreads)
+                continue;
+            guard.unlock();
+            job(w);
+            guard.lock();
+            if (--running == 0)
+                done.notify_one();
+        }
+    }
+
+    // job(w) on workers 0 .. numThreads - 1, the caller being worker 0
+    void run(int numThreads, const function<void(int)> &f) {
+        lock_guard<mutex> runGuard(runLock);
+        inRun = 1;
+        {
+            lock_guard<mutex> guard(lock);
+            while ((int)threads.size() < numThreads - 1)
+                threads.emplace_back(&WorkPool::work, this, (int)threads.size() + 1);
+            job = f;
+            jobThreads = numThreads;
+            running = numThreads - 1;
+            generation++;
+        }
+        wake.notify_all();
+        f(0);
+        unique_lock<mutex> guard(lock);
+        done.wait(guard, [&] { return running == 0; });
+        inRun = 0;
+    }
+};
+thread_local bool WorkPool::inRun = 0;
+WorkPool workPool;
+
+// run tasks 0..numTasks-1 on numThreads threads of workPool (the caller is
+// thread 0). every thread starts on a contiguous share of the tasks and,
+// once its own queue runs dry, steals from the back of the other queues.
+// with one thread or one task, or inside a task of another run, the tasks
+// run in order on the caller
+template <class Task>
+void runWorkStealing(size_t numTasks, int numThreads, const Task &task) {
+    if (numThreads <= 1 || numTasks <= 1 || WorkPool::inRun) {
+        for (size_t t = 0; t < numTasks; t++)
+            task(t, 0);
+        return;
+    }
+    struct Queue {
+        mutex lock;
+        deque<size_t> tasks;
+    };
+    vector<Queue> queues(numThreads);
+    for (size_t t = 0; t < numTasks; t++)
+        queues[t * numThreads / numTasks].tasks.push_back(t);
+
+    auto worker = [&](int w) {
+        while (true) {
+            size_t t = 0;
+            bool found = 0;
+            {
+                lock_guard<mutex> guard(queues[w].lock);
+                if (!queues[w].tasks.empty()) {
+                    t = queues[w].tasks.front();
+                    queues[w].tasks.pop_front();
+                    found = 1;
+                }
+            }
+            for (int v = 1; !found && v < numThreads; v++) {
+                Queue &victim = queues[(w + v) % numThreads];
+                lock_guard<mutex> guard(victim.lock);
+                if (!victim.tasks.empty()) {
+                    t = victim.tasks.back();
+                    victim.tasks.pop_back();
+                    found = 1;
+                }
+            }
+            if (!found)
+                return;
+            task(t, w);
+        }
+    };
+    workPool.run(numThreads, worker);
+}
+
+// split order (word ids of dictionary) into about numChunks contiguous
+// ranges [first, second) holding roughly the same number of characters,
+// since the cost of a word is proportional to its length
+vector<pair<size_t, size_t>> balancedChunks(const Dictionary &dictionary,
+                                            const vector<uint32_t> &order, size_t numChunks) {
+    size_t total = 0;
+    for (uint32_t w: order)
+        total += dictionary.length[w];
+    vector<pair<size_t, size_t>> chunks;
+    size_t first = 0, acc = 0;
+    for (size_t i = 0; i < order.size(); i++) {
+        acc += dictionary.length[order[i]];
+        if (acc * numChunks >= total * (chunks.size() + 1) || i + 1 == order.size()) {
+            chunks.push_back({first, i + 1});
+            first = i + 1;
+        }
+    }
+    return chunks;
+}
+
+/* TRIE SCORING (-trie) */
+
+// the dictionary as a trie in preorder. a node is its character, its depth
+// and the range of trie.words ending at it, so a DFS is a scan over the
+// nodes in which the DP row of a node is computed from the row of the last
+// node one level up, and words sharing a prefix share its rows
+struct TrieNode {
+    char c;
+    uint32_t depth;
+    uint32_t termBegin, termEnd;
+};
+struct Trie {
+    bool built = 0;
+    vector<TrieNode> nodes; // nodes[0] is the root
+    vector<uint32_t> words; // word ids in sorted order
+    vector<pair<size_t, size_t>> subtrees; // node ranges of the children of the root
+    size_t maxDepth = 0;
+};
+Trie trie;
+
+void buildTrie(const Dictionary &dictionary) {
+    vector<uint32_t> &ids = trie.words;
+    ids.resize(dictionary.size());
+    for (uint32_t w = 0; w < ids.size(); w++)
+        ids[w] = w;
+    stable_sort(ids.begin(), ids.end(), [&](uint32_t a, uint32_t b) {
+        return dictionary[a] < dictionary[b];
+    });
+    trie.nodes.assign(1, {0, 0, 0, 0});
+    trie.maxDepth = 0;
+    for (uint32_t r = 0; r < ids.size(); r++) {
+        string_view x = dictionary[ids[r]];
+        if (r > 0 && x == dictionary[ids[r - 1]]) {
+            // duplicate: ends at the same node as the previous word
+            trie.nodes.back().termEnd++;
+            continue;
+        }
+        size_t lcp = 0;
+        if (r > 0) {
+            string_view prev = dictionary[ids[r - 1]];
+            while (lcp < x.size() && lcp < prev.size() && x[lcp] == prev[lcp])
+                lcp++;
+        }
+        for (size_t d = lcp; d < x.size(); d++)
+            trie.nodes.push_back({x[d], (uint32_t)d + 1, r, r});
+        trie.nodes.back().termEnd = r + 1;
+        trie.maxDepth = max(trie.maxDepth, x.size());
+    }
+    trie.subtrees.clear();
+    for (size_t v = 1; v < trie.nodes.size(); v++) {
+        if (trie.nodes[v].depth == 1) {
+            if (!trie.subtrees.empty())
+                trie.subtrees.back().second = v;
+            trie.subtrees.push_back({v, trie.nodes.size()});
+        }
+    }
+    trie.built = 1;
+}
+
+// one semi-global row of the matrix: cur from prev for character c of x,
+// with first the value of the first column
+long long trieRow(const int *prev, int *cur, int first, char c, string_view y) {
+    cur[0] = first;
+    for (size_t j = 1; j <= y.size(); j++)
+        cur[j] = min(prev[j - 1] + d_subst(c, y[j - 1]), min(cur[j - 1] + d_insrt(), prev[j] + d_delet()));
+    return y.size();
+}
+
+// rows, running minimums and path of trieScore, reused across queries
+struct TrieScratch {
+    vector<int> freeRows, freeBest;
+    vector<int> anchRows, anchBest;
+    vector<int> tail;
+    vector<char> path;
+};
+thread_local TrieScratch trieScratch;
+
+// score the words ending in nodes [first, last), a run of whole subtrees
+// of the root. rows of the free-start matrix (k >= depth) are shared by all
+// words below a node; with -o a word of length n needs k = max(n-|y|+1, 1):
+//  - n <= |y|: k = 1, so rows of a second matrix anchored at the start of
+//    x are kept for the first |y| levels
+//  - n > |y|: the rows up to n-|y| are the shared free-start ones, and only
+//    the last |y| rows, whose first column rises, are computed per word
+long long trieScore(string_view y, size_t first, size_t last, vector<int> &distances) {
+    size_t m = y.size();
+    size_t w = m + 1;
+    long long cells = 0;
+    TrieScratch &sc = trieScratch;
+    countGrowth(sc.freeRows, (trie.maxDepth + 1) * w);
+    sc.freeRows.resize((trie.maxDepth + 1) * w);
+    sc.freeBest.resize(trie.maxDepth + 1);
+    sc.anchRows.resize(opt_o ? (m + 1) * w : 0);
+    sc.anchBest.resize(m + 1);
+    sc.tail.resize(2 * w);
+    sc.path.resize(trie.maxDepth + 1);
+    for (size_t j = 0; j <= m; j++)
+        sc.freeRows[j] = j;
+    sc.freeBest[0] = INF;
+    if (opt_o) {
+        for (size_t j = 0; j <= m; j++)
+            sc.anchRows[j] = j;
+        sc.anchBest[0] = INF;
+    }
+
+    for (size_t v = first; v < last; v++) {
+        const TrieNode &node = trie.nodes[v];
+        size_t d = node.depth;
+        sc.path[d] = node.c;
+        int *row = &sc.freeRows[d * w];
+        cells += trieRow(row - w, row, 0, node.c, y);
+        sc.freeBest[d] = min(sc.freeBest[d - 1], row[m]);
+        if (opt_o && d <= m) {
+            int *anch = &sc.anchRows[d * w];
+            cells += trieRow(anch - w, anch, d * d_delet(), node.c, y);
+            sc.anchBest[d] = min(sc.anchBest[d - 1], anch[m]);
+        }
+        if (node.termBegin == node.termEnd)
+            continue;
+
+        size_t n = d;
+        int dist;
+        if (!opt_o)
+            dist = sc.freeBest[n];
+        else if (n <= m)
+            dist = sc.anchBest[n];
+        else {
+            dist = sc.freeBest[n - m];
+            const int *prev = &sc.freeRows[(n - m) * w];
+            for (size_t i = n - m + 1; i <= n; i++) {
+                int *cur = &sc.tail[(i % 2) * w];
+                cells += trieRow(prev, cur, (i - (n - m)) * d_delet(), sc.path[i], y);
+                dist = min(dist, cur[m]);
+                prev = cur;
+            }
+        }
+        for (uint32_t r = node.termBegin; r < node.termEnd; r++)
+            distances[trie.words[r]] = dist;
+    }
+    return cells;
+}
+
+// computeDistances for -trie: the subtrees of the root are scored on the
+// work-stealing pool
+void trieDistances(const Dictionary &dictionary, string_view y, vector<int> &distances, int numThreads) {
+    distances.resize(dictionary.size());
+    const vector<pair<size_t, size_t>> &subtrees = trie.subtrees;
+    runWorkStealing(subtrees.size(), numThreads, [&](size_t t, int) {
+        [[maybe_unused]] long long cells = trieScore(y, subtrees[t].first, subtrees[t].second, distances);
+        COUNT(M_CELLS, cells);
+        COUNT(M_TRIE_CELLS, cells);
+    });
+    // every leaf holds all copies of its word and scores them once (the
+    // copies are counted by expandDuplicates, as for the other engines)
+    COUNT(M_WORDS, dictionary.numUnique());
+    COUNT(M_TRIE_FULL_CELLS, (long long)dictionary.uniqueLength * y.size());
+}
+
+// computeDistances for -e simd: words are batched in length order, so the
+// lanes of a batch run for about the same number of rows. batches are
+// scored on the work-stealing pool. only the first copy of every word is
+// scored (see expandDuplicates)
+thread_local vector<uint32_t> simdOrderScratch;
+
+void simdDistances(const Dictionary &dictionary, string_view y, SimdLevel level, vector<int> &distances,
+                   int numThreads) {
+    const size_t BATCHES_PER_TASK = 16;
+    distances.resize(dictionary.size());
+    int lanes = simdLanes(level);
+    uint64_t yMask = disjointMask(y);
+    vector<uint32_t> &order = simdOrderScratch;
+    countGrowth(order, dictionary.numUnique());
+    order.clear();
+    for (uint32_t w: dictionary.byLength) {
+        if (!dictionary.isFirstCopy(w))
+            continue;
+        if (disjointWord(dictionary, w, yMask))
+            distances[w] = y.size();
+        else
+            order.push_back(w);
+    }
+
+    size_t numBatches = (order.size() + lanes - 1) / lanes;
+    size_t numTasks = (numBatches + BATCHES_PER_TASK - 1) / BATCHES_PER_TASK;
+    runWorkStealing(numTasks, numThreads, [&](size_t t, int) {
+        size_t first = t * BATCHES_PER_TASK * lanes;
+        size_t last = min(order.size(), first + BATCHES_PER_TASK * lanes);
+        for (size_t i = first; i < last; i += lanes) {
+            SimdBatch b;
+            for (size_t p = i; p < min(last, i + lanes); p++) {
+                string_view x = dictionary[order[p]];
+                if (x.size() > SIMD_MAX_LEN || y.size() > SIMD_MAX_LEN)
+                    distances[order[p]] = k_dist_bitpar(x, y, chooseK(x, y), INF);
+                else
+                    b.add(order[p], x, chooseK(x, y));
+            }
+            int out[SIMD_MAX_LANES];
+            k_dist_simd_batch(level, b, y, out);
+            for (int l = 0; l < b.lanes; l++)
+                distances[b.id[l]] = out[l];
+        }
+    });
+}
+
+// computeDistances on more than one thread: chunks of order (first copies
+// only) are scored on a work-stealing pool. distances are written by index,
+// and the -wf output of each chunk is buffered and printed in chunk order,
+// so the output is the same as the serial one
+void computeDistancesParallel(const Dictionary &dictionary, string_view y,
+                              const vector<uint32_t> &order, const vector<int> &bound,
+                              vector<int> &distances, int numThreads) {
+    const size_t CHUNKS_PER_THREAD = 8;
+    vector<pair<size_t, size_t>> chunks = balancedChunks(dictionary, order, numThreads * CHUNKS_PER_THREAD);
+    vector<ostringstream> wfBuffers(opt_wf ? chunks.size() : 0);
+    bool bounded = boundedMode();
+    uint64_t yMask = disjointMask(y);
+    atomic<int> sharedCutoff(INF);
+
+    runWorkStealing(chunks.size(), numThreads, [&](size_t c, int) {
+        if (opt_wf)
+            wfOut = &wfBuffers[c];
+        for (size_t i = chunks[c].first; i < chunks[c].second; i++) {
+            uint32_t id = order[i];
+            string_view x = dictionary[id];
+            if (disjointWord(dictionary, id, yMask)) {
+                distances[id] = y.size();
+                int cutoff = sharedCutoff.load(memory_order_relaxed);
+                while (bounded && (int)y.size() < cutoff && !sharedCutoff.compare_exchange_weak(cutoff, y.size()));
+                continue;
+            }
+            if (!bounded) {
+                distances[id] = k_dist(x, y, chooseK(x, y));
+                continue;
+            }
+            // tighten the cutoff shared by all threads
+            int cutoff = sharedCutoff.load(memory_order_relaxed);
+            if (!bound.empty() && bound[id] > cutoff) {
+                COUNT(M_PRUNED, 1);
+                distances[id] = bound[id];
+                continue;
+            }
+            int dist = boundedDist(x, y, cutoff);
+            while (dist < cutoff && !sharedCutoff.compare_exchange_weak(cutoff, dist));
+            distances[id] = dist;
+        }
+        wfOut = &cout;
+    });
+
+    for (ostringstream &buffer: wfBuffers)
+        cout << buffer.str();
+}
+
+/* LENGTH BUCKETS (-o) */
+
+// with -o, k = max(|x|-|y|+1, 1) depends on x only through its length, so
+// the words of one length (a bucket of dictionary.byLength) share the shape
+// of their matrix: n, m and the number of free starts. a bucket is scored
+// with that shape fixed, and its scratch buffers are sized once. a
+// substring of x is at most |x| long, so every word of a bucket shorter
+// than y is at least |y| - |x| insertions away from it: with -b, buckets
+// are scored in order of that bound, and a bucket whose bound is above the
+// best distance so far is skipped whole
+int lengthBound(size_t n, size_t m) {
+    int inserted = max((int)m - (int)n, 0);
+    return costModel ? inserted * costModel->minInsrt() : inserted;
+}
+
+// k_dist_bitpar_word for every word of a bucket of length n: the first
+// k - 1 rows start a substring for free and the others do not, so they are
+// two loops of fixed length instead of a test per row. returns the cutoff
+// lowered by the distances found (with Bounded, as in k_dist)
+template <bool Bounded>
+int bitparBucket(const Dictionary &dictionary, const vector<uint32_t> &ids, string_view y, size_t n,
+                 size_t k, int cutoff, vector<int> &distances) {
+    const PeqTable &t = peqFor(y);
+    size_t m = y.size();
+    if (m == 0) {
+        for (uint32_t id: ids)
+            distances[id] = 0;
+        return Bounded ? min(cutoff, 0) : cutoff;
+    }
+    uint64_t high = 1ULL << (m - 1);
+    for (uint32_t id: ids) {
+        const char *x = &dictionary.pool[dictionary.offset[id]];
+        int minDist = INF;
+        int score = m;
+        uint64_t pv = ~0ULL, mv = 0;
+        size_t i = 0;
+        // one row for character i of x; true once the word can stop
+        auto row = [&](uint64_t start) {
+            uint64_t eq = t.peq[(unsigned char)x[i]];
+            uint64_t xv = eq | mv;
+            uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+            uint64_t ph = mv | ~(xh | pv);
+            uint64_t mh = pv & xh;
+            if (ph & high)
+                score++;
+            else if (mh & high)
+                score--;
+            ph = (ph << 1) | start;
+            mh <<= 1;
+            pv = mh | ~(xv | ph);
+            mv = ph & xv;
+            minDist = min(minDist, score);
+            return Bounded && score - (int)(n - i - 1) > min(minDist - 1, cutoff);
+        };
+        bool stop = 0;
+        for (; i < k - 1 && !stop; i++)
+            stop = row(0);
+        for (; i < n && !stop; i++)
+            stop = row(1);
+        COUNT_WORD(i * m, i < n);
+        if (Bounded && minDist > cutoff)
+            minDist = cutoff + 1;
+        distances[id] = minDist;
+        if (Bounded)
+            cutoff = min(cutoff, minDist);
+    }
+    return cutoff;
+}
+
+// the other engines and cost models take the k of the bucket per word,
+// with the Wagner-Fischer scratch grown to the bucket's shape up front
+template <bool Bounded>
+int kdistBucket(const Dictionary &dictionary, const vector<uint32_t> &ids, string_view y, size_t n,
+                size_t k, int cutoff, vector<int> &distances) {
+    scratchMatrix(n, y.size());
+    for (uint32_t id: ids) {
+        string_view x = dictionary[id];
+        if (Bounded && histogramFilters(y) && histogramBound(x, y) > cutoff) {
+            COUNT(M_PRUNED, 1);
+            distances[id] = cutoff + 1;
+            continue;
+        }
+        distances[id] = k_dist(x, y, k, Bounded ? cutoff : INF);
+        if (Bounded)
+            cutoff = min(cutoff, distances[id]);
+    }
+    return cutoff;
+}
+
+template <bool Bounded>
+int scoreBucket(const Dictionary &dictionary, const vector<uint32_t> &ids, string_view y, size_t n,
+                int cutoff, vector<int> &distances) {
+    size_t k = max((int)n - (int)y.size() + 1, 1);
+    if (!costModel && opt_engine == ENGINE_BITPAR && y.size() >= 1 && y.size() <= 64)
+        return bitparBucket<Bounded>(dictionary, ids, y, n, k, cutoff, distances);
+    return kdistBucket<Bounded>(dictionary, ids, y, n, k, cutoff, distances);
+}
+
+// a run of the words of one length, from byLength[first] to byLength[last]
+struct BucketRun {
+    size_t length, first, last;
+};
+// runs of a query and words of a run still to score, reused across queries
+thread_local vector<BucketRun> bucketRunScratch;
+thread_local vector<uint32_t> bucketScratch;
+
+// computeDistances for -o (first copies only): runs of at most
+// WORDS_PER_TASK words of a bucket are scored on the work-stealing pool,
+// lengths |y| and up first (bound 0), then |y| - 1 down. distances are
+// written by index, so they come back in dictionary order
+void bucketDistances(const Dictionary &dictionary, string_view y, vector<int> &distances, int numThreads) {
+    const size_t WORDS_PER_TASK = 1024;
+    size_t m = y.size();
+    size_t longest = dictionary.lengthStart.size() - 2;
+    vector<BucketRun> &runs = bucketRunScratch;
+    runs.clear();
+    auto addBucket = [&](size_t len) {
+        for (size_t p = dictionary.lengthStart[len]; p < dictionary.lengthStart[len + 1]; p += WORDS_PER_TASK)
+            runs.push_back({len, p, min(p + WORDS_PER_TASK, (size_t)dictionary.lengthStart[len + 1])});
+    };
+    for (size_t len = m; len <= longest; len++)
+        addBucket(len);
+    for (size_t len = min(m, longest + 1); len-- > 1;)
+        addBucket(len);
+
+    bool bounded = boundedMode();
+    uint64_t yMask = disjointMask(y);
+    atomic<int> sharedCutoff(INF);
+    auto scoreRun = [&](size_t r) {
+        const BucketRun &run = runs[r];
+        int low = lengthBound(run.length, m);
+        int cutoff = sharedCutoff.load(memory_order_relaxed);
+        vector<uint32_t> &ids = bucketScratch;
+        countGrowth(ids, run.last - run.first);
+        ids.clear();
+        for (size_t p = run.first; p < run.last; p++) {
+            uint32_t id = dictionary.byLength[p];
+            if (!dictionary.isFirstCopy(id))
+                continue;
+            if (disjointWord(dictionary, id, yMask)) {
+                distances[id] = m;
+                cutoff = min(cutoff, (int)m);
+            } else if (bounded && low > cutoff) {
+                COUNT(M_PRUNED, 1);
+                distances[id] = low;
+            } else
+                ids.push_back(id);
+        }
+        if (bounded)
+            cutoff = scoreBucket<true>(dictionary, ids, y, run.length, cutoff, distances);
+        else
+            scoreBucket<false>(dictionary, ids, y, run.length, INF, distances);
+        for (int shared = sharedCutoff.load(memory_order_relaxed);
+             bounded && cutoff < shared && !sharedCutoff.compare_exchange_weak(shared, cutoff););
+    };
+    runWorkStealing(runs.size(), numThreads, [&](size_t r, int) { scoreRun(r); });
+}
+
+/* WHOLE WORDS (-word, -bk) */
+
+// -word: the distance of a word is the Levenshtein distance from all of it
+// to y, rather than the minimum over its substrings
+
+// two-row Wagner-Fischer pass for -cost and for y longer than 64 characters
+thread_local vector<int> wordRowScratch;
+
+template <class Cost>
+int w_dist_wf(string_view x, string_view y, const Cost &cost) {
+    size_t m = y.size();
+    countGrowth(wordRowScratch, 2 * (m + 1));
+    wordRowScratch.resize(2 * (m + 1));
+    int *prev = wordRowScratch.data(), *cur = prev + m + 1;
+    prev[0] = 0;
+    for (size_t j = 1; j <= m; j++)
+        prev[j] = prev[j - 1] + cost.insrt(y[j - 1]);
+    for (size_t i = 1; i <= x.size(); i++) {
+        cur[0] = prev[0] + cost.delet(x[i - 1]);
+        for (size_t j = 1; j <= m; j++) {
+            int r1 = prev[j - 1] + cost.subst(x[i - 1], y[j - 1]);
+            int r2 = cur[j - 1] + cost.insrt(y[j - 1]);
+            int r3 = prev[j] + cost.delet(x[i - 1]);
+            cur[j] = min(r1, min(r2, r3));
+        }
+        swap(prev, cur);
+    }
+    COUNT_WORD(x.size() * m, 0);
+    return prev[m];
+}
+
+// k_dist_bitpar_word with no free start (k = 1), so the score after the
+// last character of x is the distance of the whole of x
+int w_dist_bitpar(string_view x, string_view y) {
+    size_t m = y.size();
+    if (m == 0 || m > 64)
+        return w_dist_wf(x, y, UnitCost());
+    const PeqTable &t = peqFor(y);
+    int score = m;
+    uint64_t high = 1ULL << (m - 1);
+    uint64_t pv = ~0ULL, mv = 0;
+    for (char c: x) {
+        uint64_t eq = t.peq[(unsigned char)c];
+        uint64_t xv = eq | mv;
+        uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+        uint64_t ph = mv | ~(xh | pv);
+        uint64_t mh = pv & xh;
+        if (ph & high)
+            score++;
+        else if (mh & high)
+            score--;
+        ph = (ph << 1) | 1;
+        mh <<= 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+    }
+    COUNT_WORD(x.size() * m, 0);
+    return score;
+}
+
+int w_dist(string_view x, string_view y) {
+    if (costModel)
+        return w_dist_wf(x, y, *costModel);
+    return w_dist_bitpar(x, y);
+}
+
+// -bk: a BK-tree of the dictionary, built at load time. every word in the
+// subtree of a child is at distance edge from the word of its parent, so by
+// the triangle inequality the subtree holds no word within d of y unless
+// |edge - w_dist(parent, y)| <= d, and a query within a small d visits a
+// few nodes only. equal words hang off each other at edge 0. weighted
+// distances need not be a metric, so -cost scans every word instead
+struct BKNode {
+    uint32_t id;
+    uint32_t edge;                 // distance to the word of the parent
+    uint32_t childBegin, childEnd; // the children, sorted by edge
+};
+struct BKTree {
+    bool built = 0;
+    vector<BKNode> nodes; // breadth-first, nodes[0] is the root
+};
+BKTree bkTree;
+
+void buildBKTree(const Dictionary &dictionary) {
+    // insert the words in dictionary order into a tree of linked children
+    struct Link {
+        uint32_t id, edge;
+        uint32_t child, sibling; // 0 if none (the root is no one's child)
+    };
+    vector<Link> links;
+    links.reserve(dictionary.size());
+    for (uint32_t w = 0; w < dictionary.size(); w++) {
+        if (w == 0) {
+            links.push_back({w, 0, 0, 0});
+            continue;
+        }
+        // y is the new word, so its peq table is built once
+        uint32_t v = 0;
+        while (true) {
+            uint32_t d = w_dist_bitpar(dictionary[links[v].id], dictionary[w]);
+            uint32_t c = links[v].child;
+            while (c != 0 && links[c].edge != d)
+                c = links[c].sibling;
+            if (c == 0) {
+                links.push_back({w, d, 0, links[v].child});
+                links[v].child = links.size() - 1;
+                break;
+            }
+            v = c;
+        }
+    }
+
+    // then lay it out breadth-first, so the children of a node are
+    // contiguous and a search only reads those within its range of edges
+    vector<BKNode> &nodes = bkTree.nodes;
+    nodes.clear();
+    nodes.reserve(links.size());
+    vector<uint32_t> linkOf;
+    vector<uint32_t> children;
+    if (!links.empty()) {
+        nodes.push_back({links[0].id, 0, 0, 0});
+        linkOf.push_back(0);
+    }
+    for (size_t v = 0; v < nodes.size(); v++) {
+        children.clear();
+        for (uint32_t c = links[linkOf[v]].child; c != 0; c = links[c].sibling)
+            children.push_back(c);
+        sort(children.begin(), children.end(), [&](uint32_t a, uint32_t b) {
+            return links[a].edge < links[b].edge;
+        });
+        nodes[v].childBegin = nodes.size();
+        for (uint32_t c: children) {
+            nodes.push_back({links[c].id, links[c].edge, 0, 0});
+            linkOf.push_back(c);
+        }
+        nodes[v].childEnd = nodes.size();
+    }
+    bkTree.built = 1;
+}
+
+// nodes still to visit and the lower bound of the distance of their subtree
+thread_local vector<pair<int, uint32_t>> bkStack;
+
+// visit(id, dist) every word of the BK-tree that can be within limit() of
+// y, where limit() may shrink as words are visited (as the threshold of
+// nearestWords does). the children in range are pushed from both ends
+// inward, so the closest one is walked first and shrinks limit() the most.
+// the rest of the words are counted as pruned
+template <class Visit, class Limit>
+void bkSearch(const Dictionary &dictionary, string_view y, Visit visit, Limit limit) {
+    const vector<BKNode> &nodes = bkTree.nodes;
+    vector<pair<int, uint32_t>> &stack = bkStack;
+    stack.clear();
+    if (!nodes.empty())
+        stack.push_back({0, 0});
+    size_t visited = 0;
+    while (!stack.empty()) {
+        auto [low, v] = stack.back();
+        stack.pop_back();
+        if (low > limit())
+            continue;
+        int d = w_dist_bitpar(dictionary[nodes[v].id], y);
+        visited++;
+        visit(nodes[v].id, d);
+        long long r = limit();
+        size_t lo = nodes[v].childBegin, hi = nodes[v].childEnd;
+        while (lo < hi && nodes[lo].edge < d - r)
+            lo++;
+        while (lo < hi && nodes[hi - 1].edge > d + r)
+            hi--;
+        countGrowth(stack, stack.size() + (hi - lo));
+        while (lo < hi) {
+            int below = d - (int)nodes[lo].edge, above = (int)nodes[hi - 1].edge - d;
+            if (below >= above)
+                stack.push_back({abs(below), lo++});
+            else
+                stack.push_back({abs(above), --hi});
+        }
+    }
+    COUNT(M_BK_NODES, visited);
+    COUNT(M_BK_SEARCHES, 1);
+    COUNT(M_PRUNED, nodes.size() - visited);
+}
+
+// computeDistances for -word. the BK-tree only visits the words that can
+// tie for the minimum, and the others get a distance above it (as with -b),
+// so -t, which prints every distance, scans every (first copy of a) word
+void wordDistances(const Dictionary &dictionary, string_view y, vector<int> &distances, int numThreads) {
+    if (bkTree.built && !costModel && !opt_t) {
+        int best = INF;
+        fill(distances.begin(), distances.end(), -1);
+        bkSearch(dictionary, y, [&](uint32_t id, int d) {
+            distances[id] = d;
+            best = min(best, d);
+        }, [&] { return best; });
+        for (int &d: distances)
+            if (d < 0)
+                d = best + 1;
+        return;
+    }
+    const size_t WORDS_PER_TASK = 4096;
+    size_t numTasks = (dictionary.size() + WORDS_PER_TASK - 1) / WORDS_PER_TASK;
+    runWorkStealing(numTasks, numThreads, [&](size_t t, int) {
+        size_t last = min(dictionary.size(), (t + 1) * WORDS_PER_TASK);
+        for (size_t w = t * WORDS_PER_TASK; w < last; w++)
+            if (scoresWord(dictionary, w))
+                distances[w] = w_dist(dictionary[w], y);
+    });
+}
+
+// q-gram bounds and scoring order of computeDistances, reused across queries
+thread_local vector<int> boundScratch;
+thread_local vector<uint32_t> orderScratch;
+
+// the distance of the first copy of every word (see computeDistances)
+void scoreFirstCopies(const Dictionary &dictionary, string_view y, vector<int> &distances, int numThreads) {
+    /* NOISY SUBSTRING MATCHING ALGORITHM */
+
+    if (opt_word) {
+        PHASE_TIMER(M_NS_SCORE);
+        return wordDistances(dictionary, y, distances, numThreads);
+    }
+
+    // the trie and simd engines compute every distance exactly, so they
+    // also serve -b and -t
+    if (trie.built && !opt_wf && !costModel) {
+        PHASE_TIMER(M_NS_SCORE);
+        return trieDistances(dictionary, y, distances, numThreads);
+    }
+    if (opt_engine == ENGINE_SIMD && !opt_wf && !costModel) {
+        PHASE_TIMER(M_NS_SCORE);
+        return simdDistances(dictionary, y, simdLevel, distances, numThreads);
+    }
+    // with -o, words are scored by length, unless -b -idx orders them by
+    // their q-gram bound instead, or -wf prints them in dictionary order
+    if (opt_o && !opt_wf && !(boundedMode() && dictIndex.built)) {
+        PHASE_TIMER(M_NS_SCORE);
+        return bucketDistances(dictionary, y, distances, numThreads);
+    }
+
+    // with -b and -idx, words are scored best-first by their q-gram bound
+    bool bounded = boundedMode();
+    vector<int> &bound = boundScratch;
+    vector<uint32_t> &order = orderScratch;
+    bound.clear();
+    order.clear();
+    if (bounded && dictIndex.built) {
+        PHASE_TIMER(M_NS_FILTER);
+        qgramBounds(y, dictionary.size(), bound);
+        boundOrder(bound, order);
+    }
+
+    PHASE_TIMER(M_NS_SCORE);
+    if (numThreads > 1) {
+        if (order.empty()) {
+            for (uint32_t w = 0; w < dictionary.size(); w++)
+                order.push_back(w);
+        }
+        order.erase(remove_if(order.begin(), order.end(), [&](uint32_t w) {
+            return !scoresWord(dictionary, w);
+        }), order.end());
+        return computeDistancesParallel(dictionary, y, order, bound, distances, numThreads);
+    }
+
+    // Compute all minimum LD distances between words x in dictionary and y
+    int cutoff = INF;
+    uint64_t yMask = disjointMask(y);
+    for (size_t i = 0; i < dictionary.size(); i++) {
+        uint32_t id = order.empty() ? i : order[i];
+        string_view x = dictionary[id];
+        if (!scoresWord(dictionary, id))
+            continue;
+        if (disjointWord(dictionary, id, yMask)) {
+            distances[id] = y.size();
+            cutoff = min(cutoff, (int)y.size());
+        } else if (!bounded)
+            distances[id] = k_dist(x, y, chooseK(x, y));
+        else if (!bound.empty() && bound[id] > cutoff) {
+            COUNT(M_PRUNED, 1);
+            distances[id] = bound[id];
+        } else {
+            distances[id] = boundedDist(x, y, cutoff);
+            cutoff = min(cutoff, distances[id]);
+        }
+    }
+}
+
+// fill distances (reused across queries, so the serial path allocates
+// nothing once its buffers have grown) with the distance of every word,
+// scoring on numThreads threads. every distinct word is scored once, and
+// words sharing no character with y not at all (see disjointWord)
+void computeDistances(const Dictionary &dictionary, string_view y, vector<int> &distances,
+                      int numThreads = opt_j) {
+    countGrowth(distances, dictionary.size());
+    distances.resize(dictionary.size());
+    scoreFirstCopies(dictionary, y, distances, numThreads);
+    expandDuplicates(dictionary, distances);
+}
+
+/* MULTI-QUERY SCORING (-batch) */
+
+// -batch scores its distinct queries in groups, with one pass over the
+// dictionary per group instead of one per query: every word is scored
+// against all the queries of the group while its characters are in cache.
+// queries of up to 64 characters are packed side by side into the
+// segments of one machine word, and one step of Myers' kernel per
+// character of the word advances all of them (Hyyro's packing). the
+// segments are kept apart by dropping the carries out of their highest
+// bits in the addition and the bits shifted out of them; longer queries
+// take the block kernel of bitpar, with a peq table of their own
+
+// queries packed into one word, in order of decreasing length, so that
+// their first rows past the free starts (k - 1) come in segment order
+struct PackedQueries {
+    vector<uint32_t> query; // index in the group of every segment
+    vector<int> length;
+    vector<int> shift;      // index of the lowest bit of every segment
+    uint64_t bottom = 0;    // lowest bit of every segment
+    uint64_t top = 0;       // highest bit of every segment
+    uint64_t peq[256] = {};
+    uint8_t segmentOf[64] = {}; // segment of every highest bit
+};
+
+struct MultiQuery {
+    vector<PackedQueries> packs;
+    vector<uint32_t> longQueries; // more than 64 characters, or none
+    vector<PeqTable> longPeq;
+};
+
+void packQueries(const vector<string_view> &ys, MultiQuery &mq) {
+    vector<uint32_t> order(ys.size());
+    for (uint32_t q = 0; q < order.size(); q++)
+        order[q] = q;
+    stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return ys[a].size() > ys[b].size();
+    });
+    int used = 64;
+    for (uint32_t q: order) {
+        string_view y = ys[q];
+        int m = y.size();
+        // an empty query has no segment to pack, and the block kernel
+        // scores it 0
+        if (m > 64 || m == 0) {
+            mq.longQueries.push_back(q);
+            mq.longPeq.emplace_back();
+            PeqTable &t = mq.longPeq.back();
+            t.y = y;
+            t.blocks = (m + 63) / 64;
+            t.peq.assign(256 * t.blocks, 0);
+            for (int j = 0; j < m; j++)
+                t.peq[(unsigned char)y[j] * t.blocks + j / 64] |= 1ULL << (j % 64);
+            continue;
+        }
+        if (used + m > 64) {
+            mq.packs.emplace_back();
+            used = 0;
+        }
+        PackedQueries &p = mq.packs.back();
+        p.segmentOf[used + m - 1] = p.query.size();
+        p.query.push_back(q);
+        p.length.push_back(m);
+        p.shift.push_back(used);
+        p.bottom |= 1ULL << used;
+        p.top |= 1ULL << (used + m - 1);
+        for (int j = 0; j < m; j++)
+            p.peq[(unsigned char)y[j]] |= 1ULL << (used + j);
+        used += m;
+    }
+}
+
+// k_dist_bitpar_word of x for every query of a pack at once, into dist
+// (by segment). the score at the highest bit of a segment only changes
+// where ph or mh has that bit set, so only those are visited; every row
+// past the first has a distance <= |y|, so the minimum starts there
+void packedDistances(string_view x, const PackedQueries &p, int *score, int *dist) {
+    size_t n = x.size();
+    int segments = p.query.size();
+    for (int s = 0; s < segments; s++)
+        score[s] = dist[s] = p.length[s];
+    // the free starts of segment s end at row k - 1 (see chooseK)
+    auto anchored = [&](int s) {
+        return opt_o ? (size_t)max((int)n - p.length[s], 0) : n - 1;
+    };
+    uint64_t in = 0;
+    int next = 0;
+    uint64_t pv = ~0ULL, mv = 0;
+    for (size_t i = 0; i < n; i++) {
+        while (next < segments && i >= anchored(next))
+            in |= 1ULL << p.shift[next++];
+        uint64_t eq = p.peq[(unsigned char)x[i]];
+        uint64_t xv = eq | mv;
+        uint64_t a = eq & pv;
+        uint64_t sum = ((a & ~p.top) + (pv & ~p.top)) ^ ((a ^ pv) & p.top);
+        uint64_t xh = (sum ^ pv) | eq;
+        uint64_t ph = mv | ~(xh | pv);
+        uint64_t mh = pv & xh;
+        for (uint64_t b = ph & p.top; b; b &= b - 1)
+            score[p.segmentOf[__builtin_ctzll(b)]]++;
+        for (uint64_t b = mh & p.top; b; b &= b - 1) {
+            int s = p.segmentOf[__builtin_ctzll(b)];
+            dist[s] = min(dist[s], --score[s]);
+        }
+        ph = ((ph << 1) & ~p.bottom) | in;
+        mh = (mh << 1) & ~p.bottom;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+    }
+}
+
+// fill distances[q] with the distance of every word to ys[q], as
+// computeDistances would without -b, for the default engine (see
+// multiQueryMode). words are split into runs scored on numThreads threads
+void computeDistancesMulti(const Dictionary &dictionary, const vector<string_view> &ys,
+                           vector<vector<int>> &distances, int numThreads = opt_j) {
+    PHASE_TIMER(M_NS_SCORE);
+    const size_t WORDS_PER_TASK = 4096;
+    MultiQuery mq;
+    packQueries(ys, mq);
+    distances.resize(ys.size());
+    for (vector<int> &d: distances) {
+        countGrowth(d, dictionary.size());
+        d.resize(dictionary.size());
+    }
+    long long queryChars = 0;
+    for (string_view y: ys)
+        queryChars += y.size();
+
+    size_t numTasks = (dictionary.size() + WORDS_PER_TASK - 1) / WORDS_PER_TASK;
+    auto scoreRun = [&](size_t t) {
+        int score[64], dist[64];
+        [[maybe_unused]] long long cells = 0, words = 0;
+        size_t last = min(dictionary.size(), (t + 1) * WORDS_PER_TASK);
+        for (size_t w = t * WORDS_PER_TASK; w < last; w++) {
+            if (!dictionary.isFirstCopy(w))
+                continue;
+            string_view x = dictionary[w];
+            for (const PackedQueries &p: mq.packs) {
+                packedDistances(x, p, score, dist);
+                for (size_t s = 0; s < p.query.size(); s++)
+                    distances[p.query[s]][w] = dist[s];
+            }
+            for (size_t l = 0; l < mq.longQueries.size(); l++) {
+                const PeqTable &t = mq.longPeq[l];
+                size_t rows;
+                distances[mq.longQueries[l]][w] = k_dist_bitpar_blocks(x, t, t.y.size(), chooseK(x, t.y), INF, rows);
+            }
+            cells += x.size() * queryChars;
+            words += ys.size();
+        }
+        COUNT(M_CELLS, cells);
+        COUNT(M_WORDS, words);
+    };
+    runWorkStealing(numTasks, numThreads, [&](size_t t, int) { scoreRun(t); });
+    for (vector<int> &d: distances)
+        expandDuplicates(dictionary, d);
+}
+
+// the engine of computeDistancesMulti is bitpar at unit cost, with every
+// distance exact (so not with -b), and no other scoring mode
+bool multiQueryMode() {
+    return opt_engine == ENGINE_BITPAR && !costModel && !trie.built && !opt_word && !opt_wf && !boundedMode();
+}
+
+set<string_view> answerSet(const Dictionary &dictionary, string_view str) {
+    /* Get all strings in dictionary which have str as a substring */
+    set<string_view> res;
+    if (dictIndex.built) {
+        pair<size_t, size_t> range = indexRange(str);
+        COUNT(M_INDEX_HITS, range.second - range.first);
+        for (size_t r = range.first; r < range.second; r++)
+            res.insert(dictionary[dictIndex.wordAt[dictIndex.sa[r]]]);
+        return res;
+    }
+    for (size_t w = 0; w < dictionary.size(); w++) {
+        if (dictionary[w].find(str) != string_view::npos) {
+            res.insert(dictionary[w]);
+        }
+    }
+    return res;
+}
+
+/* NEAREST WORDS (-k, -r) */
+
+// -k and -r replace the closest words of [str] and -batch by a ranked list
+bool nearestMode() {
+    return opt_k > 0 || opt_r >= 0;
+}
+
+// a word and its distance, ordered by distance, then dictionary order
+struct Neighbor {
+    int dist;
+    uint32_t id;
+    bool operator<(const Neighbor &other) const {
+        return dist != other.dist ? dist < other.dist : id < other.id;
+    }
+};
+
+// the best k words seen so far within radius, as a max-heap. once it holds
+// k words, the worst of them is the threshold a word must beat
+struct NeighborHeap {
+    size_t k;
+    int radius;
+    vector<Neighbor> heap;
+
+    NeighborHeap(size_t k, int radius) : k(k), radius(radius) {}
+    bool full() const {
+        return heap.size() >= k;
+    }
+    int threshold() const {
+        return full() ? min(radius, heap.front().dist) : radius;
+    }
+    void push(Neighbor n) {
+        if (n.dist > radius)
+            return;
+        if (!full()) {
+            heap.push_back(n);
+            push_heap(heap.begin(), heap.end());
+        } else if (n < heap.front()) {
+            pop_heap(heap.begin(), heap.end());
+            heap.back() = n;
+            push_heap(heap.begin(), heap.end());
+        }
+    }
+};
+
+// push id, the first copy of its word, and every later copy at the same
+// distance. as each copy gets it from the same cutoff, the heap holds the
+// same words as if all of them were scored, and ties stay in dictionary order
+void pushCopies(const Dictionary &dictionary, NeighborHeap &heap, Neighbor n) {
+    heap.push(n);
+    [[maybe_unused]] long long copies = 0;
+    for (uint32_t c = dictionary.nextCopy[n.id]; c != UINT32_MAX; c = dictionary.nextCopy[c], copies++)
+        heap.push({n.dist, c});
+    COUNT(M_DUPLICATES, copies);
+}
+
+// nearestWords on more than one thread: every thread keeps its own heap,
+// and the threshold of any full heap bounds the k-th best distance of the
+// whole dictionary, so the smallest of them is shared as the cutoff
+void nearestWordsParallel(const Dictionary &dictionary, string_view y, const vector<uint32_t> &order,
+                          const vector<int> &bound, NeighborHeap &best, int numThreads) {
+    const size_t CHUNKS_PER_THREAD = 8;
+    vector<pair<size_t, size_t>> chunks = balancedChunks(dictionary, order, numThreads * CHUNKS_PER_THREAD);
+    vector<NeighborHeap> heaps(numThreads, best);
+    atomic<int> sharedCutoff(best.radius);
+
+    runWorkStealing(chunks.size(), numThreads, [&](size_t c, int w) {
+        NeighborHeap &heap = heaps[w];
+        for (size_t i = chunks[c].first; i < chunks[c].second; i++) {
+            uint32_t id = order[i];
+            int cutoff = min(heap.threshold(), sharedCutoff.load(memory_order_relaxed));
+            // the rest of the chunk is in bound order too
+            if (!bound.empty() && bound[id] > cutoff) {
+                COUNT(M_PRUNED, chunks[c].second - i);
+                break;
+            }
+            if (!dictionary.isFirstCopy(id))
+                continue;
+            pushCopies(dictionary, heap, {boundedDist(dictionary[id], y, cutoff), id});
+            int threshold = heap.threshold();
+            while (threshold < cutoff && !sharedCutoff.compare_exchange_weak(cutoff, threshold));
+        }
+    });
+
+    for (NeighborHeap &heap: heaps)
+        for (Neighbor n: heap.heap)
+            best.push(n);
+}
 
-using namespace std;
+// distances of nearestWords for the engines which compute all of them
+thread_local vector<int> nearestScratch;
 
-const int INF = numeric_limits<int>::max();
-bool opt_l = 1;
-bool opt_t = 0;
-bool opt_h = 0;
-bool opt_wf = 0;
-bool opt_o = 0;
-bool opt_cnt = 0;
-int cntGlobalCharComp = 0;
+// the k words closest to y that are within distance radius (k = SIZE_MAX
+// and radius = INF for no limit), sorted by distance, then dictionary order.
+// unlike computeDistances, the threshold of the heap is the cutoff of every
+// word (see boundedDist), and with -idx words are scored best-first by their
+// q-gram bound and the scan stops at the first bound above it, so a small
+// k scores few words in full and sorts none of the others. only the first
+// copy of every word is scored, and its copies get its distance
+void nearestWords(const Dictionary &dictionary, string_view y, size_t k, int radius,
+                  vector<Neighbor> &neighbors, int numThreads = opt_j) {
+    NeighborHeap best(k, radius);
+    swap(best.heap, neighbors);
+    best.heap.clear();
 
-int d_subst(char a, char b) {
-    if (a == b)
-        return 0;
-    return 1;
+    // the BK-tree only walks the subtrees which can hold a word within the
+    // threshold. the trie and simd engines, -wf, and -word without the tree
+    // compute every distance anyway
+    if (opt_word && bkTree.built && !costModel) {
+        PHASE_TIMER(M_NS_SCORE);
+        bkSearch(dictionary, y, [&](uint32_t id, int d) { best.push({d, id}); },
+                 [&] { return best.threshold(); });
+    } else if (((trie.built || opt_engine == ENGINE_SIMD) && !costModel) || opt_wf || opt_word) {
+        vector<int> &distances = nearestScratch;
+        computeDistances(dictionary, y, distances, numThreads);
+        PHASE_TIMER(M_NS_FILTER);
+        for (size_t w = 0; w < dictionary.size(); w++)
+            best.push({distances[w], (uint32_t)w});
+    } else {
+        vector<int> &bound = boundScratch;
+        vector<uint32_t> &order = orderScratch;
+        bound.clear();
+        order.clear();
+        if (dictIndex.built) {
+            PHASE_TIMER(M_NS_FILTER);
+            qgramBounds(y, dictionary.size(), bound);
+            boundOrder(bound, order);
+        }
+
+        PHASE_TIMER(M_NS_SCORE);
+        if (numThreads > 1) {
+            if (order.empty())
+                for (uint32_t w: dictionary.uniqueFirst)
+                    order.push_back(w);
+            nearestWordsParallel(dictionary, y, order, bound, best, numThreads);
+        } else {
+            for (size_t i = 0; i < dictionary.size(); i++) {
+                uint32_t id = order.empty() ? i : order[i];
+                int cutoff = best.threshold();
+                if (!bound.empty() && bound[id] > cutoff) {
+                    COUNT(M_PRUNED, dictionary.size() - i);
+                    break;
+                }
+                if (dictionary.isFirstCopy(id))
+                    pushCopies(dictionary, best, {boundedDist(dictionary[id], y, cutoff), id});
+            }
+        }
+    }
+
+    sort_heap(best.heap.begin(), best.heap.end());
+    swap(best.heap, neighbors);
 }
 
-int d_insrt() {
-    return 1;
+// nearestWords with the limits of -k and -r
+void nearestWords(const Dictionary &dictionary, string_view y, vector<Neighbor> &neighbors) {
+    nearestWords(dictionary, y, opt_k > 0 ? opt_k : SIZE_MAX, opt_r >= 0 ? opt_r : INF, neighbors);
 }
 
-int d_delet() {
-    return 1;
+/* TYPE-AHEAD SESSIONS (-ta) */
+
+// words more than this far above the best distance are evicted (-t needs
+// every distance, so nothing is evicted with it)
+const int TYPEAHEAD_SLACK = 2;
+
+bool typeAheadMode() {
+    return opt_ta && !opt_o && !opt_wf && !opt_word;
 }
 
-// compute Wagner-Fischer for all suffixes of x up to length k,
-// computing the LD between all prefixes of those suffixes and y
-// return the mininum LD of these substrings
-int k_dist(string x, string y, size_t k) {
-    int cntOuterCharComp = 0;
-    int minDist = INF;
-    size_t n = x.size();
-    size_t m = y.size();
+// first column of the sellers matrix of x: a free start at the first k rows
+template <class Cost>
+void firstColumn(string_view x, size_t k, int *col, const Cost &cost) {
+    for (size_t i = 0; i < k; i++)
+        col[i] = 0;
+    for (size_t i = k; i <= x.size(); i++)
+        col[i] = col[i - 1] + cost.delet(x[i - 1]);
+}
 
-    /* WAGNER-FISCHER */
+// the next column of the sellers matrix of x, for character c of y. every
+// row may end the substring, so the distance is the minimum of the column,
+// and no later column of x goes below it
+template <class Cost>
+int nextColumn(string_view x, const int *prev, int *next, char c, const Cost &cost) {
+    next[0] = prev[0] + cost.insrt(c);
+    int low = next[0];
+    for (size_t i = 1; i <= x.size(); i++) {
+        int r1 = prev[i - 1] + cost.subst(x[i - 1], c);
+        int r2 = prev[i] + cost.insrt(c);
+        int r3 = next[i - 1] + cost.delet(x[i - 1]);
+        next[i] = min(r1, min(r2, r3));
+        low = min(low, next[i]);
+    }
+    return low;
+}
 
-    // wagner-fischer matrix
-    vector<vector<int>> p(n+1, vector<int>(m+1, 0));
+// the distances of y as it is typed: every character appends one column to
+// the matrix of every live word (O(|x|) each) instead of scoring the whole
+// dictionary again, and backspace drops back to the state saved before it.
+// a word more than slack above the best distance is evicted: its column
+// is not carried on, and its last distance stays as a lower bound, since
+// distances only grow as y grows. if the best distance reaches the bound
+// of an evicted word, the word is scored again from scratch, so the
+// minimum and its ties are exact, as with -b. the first column depends on
+// k, so the optimized k of -o, which changes with |y|, is not supported
+struct TypeAheadSession {
+    struct Step {
+        int best;
+        vector<int> dist;      // exact for live words, a lower bound for evicted ones
+        vector<int32_t> slot;  // index of every word in live, -1 if evicted
+        vector<uint32_t> live;
+        vector<size_t> start;  // column of live word s: cells[start[s] .. start[s] + |x| + 1)
+        vector<int> cells;
+    };
+    const Dictionary &dictionary;
+    int slack;
+    string y;
+    // steps[m] after the first m characters of y. the steps past y are kept
+    // to be overwritten, so typing again after a backspace allocates nothing
+    vector<Step> steps;
+    vector<int> rescoreColumn;
 
-    // if we were to delete every character of x to get from x to blank string
-    for (size_t i = 1; i <= n; i++)
-        p[i][0] = p[i - 1][0] + d_delet();
+    TypeAheadSession(const Dictionary &dictionary, int slack) : dictionary(dictionary), slack(slack) {}
 
-    // if we were to insert every character of y to get from blank string to y
-    for (size_t j = 1; j <= m; j++)
-        p[0][j] = p[0][j - 1] + d_insrt();
+    // make y the typed string: back to the longest common prefix, then one
+    // character at a time
+    void type(string_view str) {
+        if (steps.empty())
+            start();
+        size_t common = 0;
+        while (common < min(y.size(), str.size()) && y[common] == str[common])
+            common++;
+        while (y.size() > common)
+            backspace();
+        for (size_t i = common; i < str.size(); i++)
+            push(str[i]);
+    }
 
-    for (size_t q = n - k + 1; q <= n; q++) {
-        int cntInnerCharComp = 0;
-        // v takes the values of the suffixes of x
-        string v = x.substr(n - q, q);
+    void backspace() {
+        y.pop_back();
+    }
 
-        // compute Wagner-Fischer matrix using v and y
-        for (size_t i = 1; i <= q; i++) {
-            for (size_t j = 1; j <= m; j++) {
-                cntInnerCharComp++;
-                int r1 = p[i - 1][j - 1] + d_subst(v[i - 1], y[j - 1]);
-                int r2 = p[i][j - 1] + d_insrt();
-                int r3 = p[i - 1][j] + d_delet();
-                p[i][j] = min(r1, min(r2, r3));
+    void push(char c) {
+        if (costModel)
+            push(c, *costModel);
+        else
+            push(c, UnitCost());
+    }
+
+    const vector<int> &distances() const {
+        return steps[y.size()].dist;
+    }
+
+private:
+    // the first copy of every word is live with its first column (and the
+    // empty substring). the other copies never have a column, and get the
+    // distance of their first copy after every character (see expandDuplicates)
+    void start() {
+        steps.emplace_back();
+        Step &s = steps[0];
+        s.best = 0;
+        s.dist.assign(dictionary.size(), 0);
+        s.slot.assign(dictionary.size(), -1);
+        size_t total = 0;
+        for (uint32_t w: dictionary.uniqueFirst)
+            addLive(s, w, total);
+        s.cells.resize(total);
+        for (size_t i = 0; i < s.live.size(); i++) {
+            uint32_t w = s.live[i];
+            if (costModel)
+                firstColumn(dictionary[w], dictionary.length[w], &s.cells[s.start[i]], *costModel);
+            else
+                firstColumn(dictionary[w], dictionary.length[w], &s.cells[s.start[i]], UnitCost());
+        }
+    }
+
+    // add word w to the live words of s, with room for its column
+    void addLive(Step &s, uint32_t w, size_t &total) {
+        s.slot[w] = s.live.size();
+        s.live.push_back(w);
+        s.start.push_back(total);
+        total += dictionary.length[w] + 1;
+    }
+
+    template <class Cost>
+    void push(char c, const Cost &cost) {
+        PHASE_TIMER(M_NS_SCORE);
+        const size_t CHUNKS_PER_THREAD = 8;
+        if (steps.size() < y.size() + 2)
+            steps.emplace_back();
+        const Step &prev = steps[y.size()];
+        Step &s = steps[y.size() + 1];
+        y.push_back(c);
+        s.dist = prev.dist;
+        s.slot.assign(dictionary.size(), -1);
+        s.live.clear();
+        s.start.clear();
+        size_t total = 0;
+        for (uint32_t w: prev.live) {
+            if (prev.dist[w] - prev.best > slack)
+                COUNT(M_PRUNED, 1);
+            else
+                addLive(s, w, total);
+        }
+        s.cells.resize(total);
+        COUNT(M_WORDS, s.live.size());
+
+        vector<pair<size_t, size_t>> chunks = balancedChunks(dictionary, s.live, opt_j * CHUNKS_PER_THREAD);
+        runWorkStealing(chunks.size(), opt_j, [&](size_t t, int) {
+            [[maybe_unused]] long long cells = 0;
+            for (size_t i = chunks[t].first; i < chunks[t].second; i++) {
+                uint32_t w = s.live[i];
+                s.dist[w] = nextColumn(dictionary[w], &prev.cells[prev.start[prev.slot[w]]],
+                                       &s.cells[s.start[i]], c, cost);
+                cells += dictionary.length[w];
+            }
+            COUNT(M_CELLS, cells);
+        });
+        s.best = INF;
+        for (uint32_t w: s.live)
+            s.best = min(s.best, s.dist[w]);
+
+        // evicted words the best distance has caught up with
+        for (bool revived = 1; revived;) {
+            revived = 0;
+            for (uint32_t w: dictionary.uniqueFirst) {
+                if (s.slot[w] >= 0 || s.dist[w] > s.best)
+                    continue;
+                addLive(s, w, total);
+                s.cells.resize(total);
+                s.dist[w] = rescore(w, &s.cells[s.start.back()], cost);
+                s.best = min(s.best, s.dist[w]);
+                revived = 1;
             }
-            minDist = min(minDist, p[i][m]);
         }
-        cntOuterCharComp += cntInnerCharComp;
+        expandDuplicates(dictionary, s.dist);
+    }
 
-        if (opt_wf) {
-            cout << "\e[0;32;40m    ";
-            for (size_t j = 0; j < m; j++)
-                cout << "  " << y[j];
-            cout << "\n ";
-            for (size_t j = 0; j <= m; j++)
-                cout << "  " << p[0][j];
-            for (size_t i = 0; i < q; i++) {
-                cout << "\n" << v[i];
-                for (size_t j = 0; j < m; j++)
-                    cout << "  " << p[i + 1][j];
-                cout << "  \e[0;30;47m" << p[i + 1][m] << "\e[0;32;40m";
+    // the last column of word w for all of y, from scratch
+    template <class Cost>
+    int rescore(uint32_t w, int *col, const Cost &cost) {
+        string_view x = dictionary[w];
+        vector<int> &column = rescoreColumn;
+        column.resize(x.size() + 1);
+        firstColumn(x, x.size(), column.data(), cost);
+        int dist = 0;
+        for (char c: y) {
+            dist = nextColumn(x, column.data(), col, c, cost);
+            copy(col, col + x.size() + 1, column.begin());
+        }
+        COUNT(M_CELLS, (long long)x.size() * y.size());
+        COUNT(M_WORDS, 1);
+        return dist;
+    }
+};
+
+/* BATCH MODE (-batch) */
+
+// a bounded queue between two stages of the batch pipeline
+template <class T>
+struct Channel {
+    mutex m;
+    condition_variable cv;
+    deque<T> items;
+    size_t capacity;
+    bool closed = 0;
+
+    Channel(size_t capacity): capacity(capacity) {}
+    void push(T item) {
+        unique_lock<mutex> lock(m);
+        cv.wait(lock, [&] { return items.size() < capacity; });
+        items.push_back(move(item));
+        cv.notify_all();
+    }
+    // 0 once the channel is closed and empty
+    bool pop(T &item) {
+        unique_lock<mutex> lock(m);
+        cv.wait(lock, [&] { return !items.empty() || closed; });
+        if (items.empty())
+            return 0;
+        item = move(items.front());
+        items.pop_front();
+        cv.notify_all();
+        return 1;
+    }
+    void close() {
+        lock_guard<mutex> lock(m);
+        closed = 1;
+        cv.notify_all();
+    }
+};
+
+enum BatchFormat { FORMAT_TSV, FORMAT_JSONL, NUM_FORMATS };
+const char *formatNames[NUM_FORMATS] = {"tsv", "jsonl"};
+BatchFormat opt_format = FORMAT_TSV;
+const char *opt_batch = nullptr;
+
+struct BatchResult {
+    int dist; // -1 if no word is within -r
+    vector<string_view> matches; // distinct closest words, sorted
+    vector<int> dists; // with -k or -r, the nearest words and their distances instead
+};
+// consecutive queries of the input and, once scored, their results.
+// equal queries of a block share one result
+struct BatchBlock {
+    vector<string> queries;
+    vector<uint32_t> resultOf;
+    vector<BatchResult> results;
+};
+
+// the minimum LD of distances and the distinct words at it, sorted
+BatchResult closestWords(const Dictionary &dictionary, const vector<int> &distances) {
+    BatchResult r;
+    r.dist = INF;
+    for (int dist: distances)
+        r.dist = min(r.dist, dist);
+    for (size_t w = 0; w < dictionary.size(); w++)
+        if (distances[w] == r.dist)
+            r.matches.push_back(dictionary[w]);
+    sort(r.matches.begin(), r.matches.end());
+    r.matches.erase(unique(r.matches.begin(), r.matches.end()), r.matches.end());
+    return r;
+}
+
+// the result of one query: its minimum LD and closest words, or with -k
+// or -r its nearest words. distances and neighbors are scratch buffers
+BatchResult scoreQuery(const Dictionary &dictionary, string_view y, vector<int> &distances,
+                       vector<Neighbor> &neighbors) {
+    BatchResult r;
+    if (nearestMode()) {
+        nearestWords(dictionary, y, neighbors);
+        r.dist = neighbors.empty() ? -1 : neighbors[0].dist;
+        for (Neighbor n: neighbors) {
+            r.matches.push_back(dictionary[n.id]);
+            r.dists.push_back(n.dist);
+        }
+        return r;
+    }
+    computeDistances(dictionary, y, distances);
+    return closestWords(dictionary, distances);
+}
+
+// distances of the queries of one pass of computeDistancesMulti
+thread_local vector<vector<int>> multiScratch;
+
+void scoreBlock(const Dictionary &dictionary, BatchBlock &block, vector<int> &distances) {
+    const size_t MULTI_QUERIES = 32;
+    // by length, then text, so that equal queries are adjacent
+    vector<uint32_t> order(block.queries.size());
+    for (uint32_t q = 0; q < order.size(); q++)
+        order[q] = q;
+    sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        const string &x = block.queries[a], &y = block.queries[b];
+        return x.size() != y.size() ? x.size() < y.size() : x < y;
+    });
+    block.resultOf.resize(order.size());
+    vector<string_view> distinct;
+    for (size_t i = 0; i < order.size(); i++) {
+        const string &y = block.queries[order[i]];
+        if (i == 0 || y != block.queries[order[i - 1]])
+            distinct.push_back(y);
+        block.resultOf[order[i]] = distinct.size() - 1;
+    }
+
+    block.results.clear();
+    if (!nearestMode() && multiQueryMode()) {
+        // MULTI_QUERIES of them per pass over the dictionary
+        vector<vector<int>> &multi = multiScratch;
+        for (size_t first = 0; first < distinct.size(); first += MULTI_QUERIES) {
+            vector<string_view> ys(distinct.begin() + first,
+                                   distinct.begin() + min(distinct.size(), first + MULTI_QUERIES));
+            computeDistancesMulti(dictionary, ys, multi);
+            for (size_t q = 0; q < ys.size(); q++)
+                block.results.push_back(closestWords(dictionary, multi[q]));
+        }
+        return;
+    }
+    vector<Neighbor> neighbors;
+    for (string_view y: distinct)
+        block.results.push_back(scoreQuery(dictionary, y, distances, neighbors));
+}
+
+void appendJsonString(string &out, string_view str) {
+    out += '"';
+    for (char c: str) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if ((unsigned char)c < 0x20) {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            out += esc;
+        } else
+            out += c;
+    }
+    out += '"';
+}
+
+// one line per query, appended to out:
+//  tsv: query, distance and the space-separated matches (and with -k or -r,
+//      the space-separated distances of the matches; the distance is empty
+//      if there is none)
+//  jsonl: {"query": ..., "distance": ..., "matches": [...]} (and "distances":
+//      [...] with -k or -r; the distance is null if there is no match)
+void formatResult(string &out, string_view query, const BatchResult &r) {
+    if (opt_format == FORMAT_TSV) {
+        out += query;
+        out += '\t';
+        if (r.dist >= 0)
+            out += to_string(r.dist);
+        out += '\t';
+        for (size_t i = 0; i < r.matches.size(); i++) {
+            if (i > 0)
+                out += ' ';
+            out += r.matches[i];
+        }
+        if (nearestMode()) {
+            out += '\t';
+            for (size_t i = 0; i < r.dists.size(); i++) {
+                if (i > 0)
+                    out += ' ';
+                out += to_string(r.dists[i]);
             }
-            cout << "\n\e[0m  Min = " << minDist << "";
-            if (opt_cnt) {
-                cout << "\nComparisons: " << cntInnerCharComp;
+        }
+    } else {
+        out += "{\"query\":";
+        appendJsonString(out, query);
+        out += ",\"distance\":";
+        out += r.dist >= 0 ? to_string(r.dist) : "null";
+        out += ",\"matches\":[";
+        for (size_t i = 0; i < r.matches.size(); i++) {
+            if (i > 0)
+                out += ',';
+            appendJsonString(out, r.matches[i]);
+        }
+        out += ']';
+        if (nearestMode()) {
+            out += ",\"distances\":[";
+            for (size_t i = 0; i < r.dists.size(); i++) {
+                if (i > 0)
+                    out += ',';
+                out += to_string(r.dists[i]);
             }
-            cout << "\n\n";
+            out += ']';
         }
+        out += '}';
     }
-    cntGlobalCharComp += cntOuterCharComp;
-    return minDist;
+    out += '\n';
 }
 
-vector<int> computeDistances(vector<string> dictionary, string y) {
-    /* NOISY SUBSTRING MATCHING ALGORITHM */
+void formatBlock(const BatchBlock &block, string &out) {
+    out.clear();
+    for (size_t q = 0; q < block.queries.size(); q++)
+        formatResult(out, block.queries[q], block.results[block.resultOf[q]]);
+}
+
+// answer every line of in (its first word, as at the Input > prompt; blank
+// lines are skipped) on out. reading, scoring and writing run on their own
+// threads and hand blocks of queries to each other, so parsing and output
+// overlap with scoring, which uses -j threads per query
+void runBatch(const Dictionary &dictionary, istream &in, ostream &out) {
+    const size_t BLOCK_QUERIES = 1 << 16;
+    const size_t BLOCKS_IN_FLIGHT = 4;
+    Channel<BatchBlock> toScore(BLOCKS_IN_FLIGHT), toWrite(BLOCKS_IN_FLIGHT);
+
+    thread reader([&] {
+        BatchBlock block;
+        for (string line; getline(in, line);) {
+            size_t first = 0;
+            while (first < line.size() && isspace((unsigned char)line[first]))
+                first++;
+            size_t last = first;
+            while (last < line.size() && !isspace((unsigned char)line[last]))
+                last++;
+            if (first == last)
+                continue;
+            block.queries.push_back(line.substr(first, last - first));
+            if (block.queries.size() == BLOCK_QUERIES) {
+                toScore.push(move(block));
+                block = BatchBlock();
+            }
+        }
+        if (!block.queries.empty())
+            toScore.push(move(block));
+        toScore.close();
+    });
+    thread writer([&] {
+        BatchBlock block;
+        string text;
+        while (toWrite.pop(block)) {
+            PHASE_TIMER(M_NS_OUTPUT);
+            formatBlock(block, text);
+            out.write(text.data(), text.size());
+        }
+        out.flush();
+    });
 
-    // Compute all minimum LD distances between words x in dictionary and y
     vector<int> distances;
+    for (BatchBlock block; toScore.pop(block);) {
+        scoreBlock(dictionary, block, distances);
+        toWrite.push(move(block));
+    }
+    toWrite.close();
+    reader.join();
+    writer.join();
+}
+
+/* SERVER MODE (-serve) */
+
+const char *opt_serve = nullptr;
+size_t opt_cache = 4096;
+
+// formatted results of recent requests, keyed by their options and query.
+// a full cache drops the least recently used one
+struct ResultCache {
+    typedef list<pair<string, string>> Entries;
+    mutex m;
+    size_t capacity = 0;
+    Entries entries; // most recently used first
+    unordered_map<string, Entries::iterator> index;
+
+    bool get(const string &key, string &result) {
+        lock_guard<mutex> guard(m);
+        auto it = index.find(key);
+        if (it == index.end())
+            return 0;
+        entries.splice(entries.begin(), entries, it->second);
+        result = it->second->second;
+        return 1;
+    }
+    void put(const string &key, const string &result) {
+        lock_guard<mutex> guard(m);
+        if (capacity == 0 || index.count(key))
+            return;
+        entries.emplace_front(key, result);
+        index[key] = entries.begin();
+        if (entries.size() > capacity) {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+    }
+    size_t size() {
+        lock_guard<mutex> guard(m);
+        return entries.size();
+    }
+};
+ResultCache resultCache;
+
+// request counters, and the latencies of the last LATENCY_WINDOW requests
+// for the percentiles of -stats
+struct ServerStats {
+    static const size_t LATENCY_WINDOW = 4096;
+    mutex m;
+    long long hits = 0, misses = 0;
+    double hitUs = 0, missUs = 0;
+    vector<double> recent;
+    size_t next = 0;
 
-    // k = x.size() with default algorithm, or max(1, |x|-|y|+1) with optimized version
-    int k;
-    for (string x: dictionary) {
-        if (opt_o)
-            k = max((int)x.size() - (int)y.size() + 1, 1);
+    void record(bool hit, double us) {
+        lock_guard<mutex> guard(m);
+        (hit ? hits : misses)++;
+        (hit ? hitUs : missUs) += us;
+        if (recent.size() < LATENCY_WINDOW)
+            recent.push_back(us);
         else
-            k = x.size();
-        distances.push_back(k_dist(x, y, k));
+            recent[next] = us;
+        next = (next + 1) % LATENCY_WINDOW;
+    }
+    string json() {
+        lock_guard<mutex> guard(m);
+        vector<double> sorted(recent);
+        sort(sorted.begin(), sorted.end());
+        auto percentile = [&](int p) {
+            return sorted.empty() ? 0 : sorted[(sorted.size() - 1) * p / 100];
+        };
+        long long requests = hits + misses;
+        ostringstream out;
+        out << fixed << setprecision(3) << "{\"requests\":" << requests << ",\"hits\":" << hits
+            << ",\"misses\":" << misses << ",\"hit_rate\":" << (requests ? (double)hits / requests : 0)
+            << ",\"cache_entries\":" << resultCache.size() << ",\"cache_capacity\":" << resultCache.capacity
+            << ",\"hit_mean_us\":" << (hits ? hitUs / hits : 0) << ",\"miss_mean_us\":"
+            << (misses ? missUs / misses : 0) << ",\"p50_us\":" << percentile(50) << ",\"p99_us\":"
+            << percentile(99) << ",\"max_us\":" << (sorted.empty() ? 0 : sorted.back()) << "}\n";
+        return out.str();
+    }
+};
+ServerStats serverStats;
+
+// the options of [str] are globals, so requests are scored one at a time
+// (each on -j threads), with the globals set to their options under the
+// lock; cache hits and connections run concurrently
+mutex scoreLock;
+
+// the options the server was started with, which requests start from
+struct RequestOptions {
+    bool o;
+    size_t k;
+    int r;
+};
+RequestOptions serverOptions;
+
+// answer one request line:
+//  [-o] [-k n] [-r d] str: the result of str (as -batch would format it)
+//      with these options in place of the ones the server was started with.
+//      words after str are ignored, as at the Input > prompt. an unknown
+//      option, or one missing its value or the str after it, is an error
+//  -stats: a JSON line of the cache hits and misses and of the latencies
+string answerRequest(const Dictionary &dictionary, const vector<string> &request, vector<int> &distances,
+                     vector<Neighbor> &neighbors) {
+    if (request.size() == 1 && request[0] == "-stats")
+        return serverStats.json();
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    bool o = serverOptions.o;
+    size_t k = serverOptions.k;
+    int r = serverOptions.r;
+    string error;
+    size_t i = 0;
+    for (; i < request.size() && error.empty() && request[i][0] == '-'; i++) {
+        if (request[i] == "-o")
+            o = 1;
+        else if (request[i] == "-k" || request[i] == "-r") {
+            const string &option = request[i];
+            try {
+                if (++i == request.size())
+                    throw invalid_argument(option);
+                int n = stoi(request[i]);
+                if (n < (option == "-k" ? 1 : 0))
+                    error = "Unrecognized argument: " + option + " " + request[i];
+                else if (option == "-k")
+                    k = n;
+                else
+                    r = n;
+            } catch (...) {
+                error = option + " must be followed by an integer";
+            }
+        } else
+            error = "Unrecognized argument: " + request[i];
+    }
+    if (error.empty() && i == request.size())
+        error = "Missing query after the options";
+    if (!error.empty()) {
+        string out = opt_format == FORMAT_TSV ? "error\t" + error : "{\"error\":";
+        if (opt_format == FORMAT_JSONL) {
+            appendJsonString(out, error);
+            out += '}';
+        }
+        return out + "\n";
     }
-    return distances;
+
+    // the first word after the options, as at the Input > prompt and in -batch
+    const string &y = request[i];
+    string key = to_string(o) + " " + to_string(k) + " " + to_string(r) + " " + (opt_cost ? opt_cost : "") + "\n" + y;
+    string result;
+    bool hit = resultCache.get(key, result);
+    if (!hit) {
+        lock_guard<mutex> guard(scoreLock);
+        // another request may have scored it while this one waited
+        hit = resultCache.get(key, result);
+        if (!hit) {
+            opt_o = o;
+            opt_k = k;
+            opt_r = r;
+            formatResult(result, y, scoreQuery(dictionary, y, distances, neighbors));
+            resultCache.put(key, result);
+        }
+    }
+    serverStats.record(hit, chrono::duration<double, micro>(chrono::steady_clock::now() - start).count());
+    return result;
 }
 
-set<string> answerSet(vector<string> dictionary, string str) {
-    /* Get all strings in dictionary which have str as a substring */
-    set<string> res;
-    for (string x: dictionary) {
-        if (x.find(str) != string::npos) {
-            res.insert(x);
+// answer the lines of one connection until the client closes it
+void serveConnection(const Dictionary &dictionary, int fd) {
+    string buffer;
+    size_t pos = 0;
+    char chunk[1 << 16];
+    vector<int> distances;
+    vector<Neighbor> neighbors;
+    while (true) {
+        size_t nl = buffer.find('\n', pos);
+        if (nl == string::npos) {
+            buffer.erase(0, pos);
+            pos = 0;
+            ssize_t got = recv(fd, chunk, sizeof(chunk), 0);
+            if (got <= 0)
+                break;
+            buffer.append(chunk, got);
+            continue;
+        }
+        istringstream iss(buffer.substr(pos, nl - pos));
+        pos = nl + 1;
+        vector<string> request;
+        for (string s; iss >> s;)
+            request.push_back(s);
+        if (request.empty())
+            continue;
+        string reply = answerRequest(dictionary, request, distances, neighbors);
+        PHASE_TIMER(M_NS_OUTPUT);
+        size_t sent = 0;
+        while (sent < reply.size()) {
+            ssize_t n = send(fd, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+                break;
+            sent += n;
         }
+        if (sent < reply.size())
+            break;
     }
-    return res;
+    close(fd);
+}
+
+// listen on addr: [host]:port for TCP (127.0.0.1 by default), anything
+// else for the path of a Unix domain socket. exits on failure
+int listenOn(const char *addr) {
+    string a(addr);
+    size_t colon = a.rfind(':');
+    int fd;
+    if (colon != string::npos) {
+        sockaddr_in sin = {};
+        sin.sin_family = AF_INET;
+        const char *port = addr + colon + 1;
+        char *end;
+        errno = 0;
+        long portNum = strtol(port, &end, 10);
+        bool validPort = isdigit((unsigned char)*port) && *end == '\0' && errno == 0 && portNum >= 1 &&
+                         portNum <= 65535;
+        sin.sin_port = htons(portNum);
+        string host = colon == 0 ? "127.0.0.1" : a.substr(0, colon);
+        if (!validPort || inet_pton(AF_INET, host.c_str(), &sin.sin_addr) != 1) {
+            cerr << "Invalid address: " << addr << "\n";
+            exit(1);
+        }
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            perror("Failed to create server socket");
+            exit(1);
+        }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (::bind(fd, (sockaddr *)&sin, sizeof(sin)) < 0) {
+            perror("Failed to bind server socket");
+            exit(1);
+        }
+    } else {
+        sockaddr_un sun = {};
+        sun.sun_family = AF_UNIX;
+        if (a.size() >= sizeof(sun.sun_path)) {
+            cerr << "Socket path too long: " << addr << "\n";
+            exit(1);
+        }
+        strcpy(sun.sun_path, addr);
+        // only a stale socket (of an earlier -serve) is replaced, never a file
+        struct stat st;
+        if (lstat(addr, &st) == 0) {
+            if (!S_ISSOCK(st.st_mode)) {
+                cerr << "Not a socket, refusing to replace: " << addr << "\n";
+                exit(1);
+            }
+            unlink(addr);
+        }
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            perror("Failed to create server socket");
+            exit(1);
+        }
+        if (::bind(fd, (sockaddr *)&sun, sizeof(sun)) < 0) {
+            perror("Failed to bind server socket");
+            exit(1);
+        }
+    }
+    if (listen(fd, SOMAXCONN) < 0) {
+        perror("Failed to listen on server socket");
+        exit(1);
+    }
+    return fd;
+}
+
+// answer requests on addr until killed, one thread per connection
+void runServer(const Dictionary &dictionary, const char *addr) {
+    resultCache.capacity = opt_cache;
+    serverOptions = {opt_o, opt_k, opt_r};
+    int fd = listenOn(addr);
+    cerr << "Listening on " << addr << "\n";
+    while (true) {
+        int client = accept(fd, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Failed to accept connection");
+            exit(1);
+        }
+        thread(serveConnection, cref(dictionary), client).detach();
+    }
+}
+
+/* TEST HELPERS */
+
+// counter-based random numbers: draw i of stream (seed, index) is a hash
+// of the three (splitmix64), so every -t trial and -v query has its own
+// stream, and its draws do not depend on the thread that runs it, on the
+// other streams or on the platform's rand()
+uint64_t mix64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
 }
 
-string randomEdit(string str, size_t numEdits) {
+struct StreamRng {
+    uint64_t key;
+    uint64_t counter = 0;
+
+    StreamRng(uint64_t seed, uint64_t index): key(mix64(mix64(seed) ^ index)) {}
+    uint64_t next() {
+        return mix64(key + ++counter * 0x9E3779B97F4A7C15ULL);
+    }
+    // uniform in [0, n)
+    size_t below(size_t n) {
+        return next() % n;
+    }
+    // uniform in [0, 1)
+    double unit() {
+        return (next() >> 11) * 0x1.0p-53;
+    }
+    // failures before the first success of Bernoulli(p) draws, as
+    // geometric_distribution, but the same on every platform
+    int geometric(double p) {
+        int k = 0;
+        while (unit() >= p)
+            k++;
+        return k;
+    }
+};
+
+string randomEdit(string str, size_t numEdits, StreamRng &rng) {
     if (numEdits == 0)
         return str;
     vector<tuple<size_t, int, char>> edits; // {location, type (insrt, delet, subst), char}
@@ -178,21 +3613,21 @@ string randomEdit(string str, size_t numEdits) {
     size_t e = numEdits;
     while (e--) {
         // pick type of edit
-        int type = (totalEditedIndices == str.size()) ? 0 : rand() % 3;
+        int type = (totalEditedIndices == str.size()) ? 0 : rng.below(3);
         // pick edit location
         int loc;
         if (type == 0) {
-            loc = rand() % (str.size() + 1); // could insert after last char
+            loc = rng.below(str.size() + 1); // could insert after last char
         } else {
-            loc = rand() % (str.size() - totalEditedIndices);
+            loc = rng.below(str.size() - totalEditedIndices);
             for (; !openToEdit[loc]; loc++); // move to next valid position
             openToEdit[loc] = 0;
             totalEditedIndices++;
         }
         // pick character
-        char c = (rand() % ('z' - 'a' + 1)) + 'a';
+        char c = rng.below('z' - 'a' + 1) + 'a';
         if (type == 2)
-            for (; c == str[loc]; c = rand()); // make sure c != char already in place
+            for (; c == str[loc]; c = rng.next()); // make sure c != char already in place
         edits.push_back(make_tuple(loc, type, c));
     }
     /* Compute noisy version of str */
@@ -202,8 +3637,9 @@ string randomEdit(string str, size_t numEdits) {
     for (size_t i = 0; i < str.size(); i++) {
         int action = 0; // 0 for none, 1 for deleted, 2 for substituted
         char subChar;   // character if substituted
-        for (auto edit = edits[e]; get<0>(edit) < i; edit = edits[++e]);
-        for (auto edit = edits[e]; get<0>(edit) == i; edit = edits[++e]) {
+        for (; e < edits.size() && get<0>(edits[e]) < i; e++);
+        for (; e < edits.size() && get<0>(edits[e]) == i; e++) {
+            auto edit = edits[e];
             if (get<1>(edit) == 0) // insert
                 y.push_back(get<2>(edit));
             else if (get<1>(edit) == 1) // delete
@@ -219,14 +3655,208 @@ string randomEdit(string str, size_t numEdits) {
             y.push_back(subChar);
     }
     // inserts past-end
-    for (auto edit = edits[e]; e < edits.size(); e++) {
-        y.push_back(get<2>(edit));
+    for (; e < edits.size(); e++) {
+        y.push_back(get<2>(edits[e]));
     }
     // convert to string
     string noisy(y.begin(), y.end());
     return noisy;
 }
 
+// compare every engine against the reference engine on all words of
+// dictionary, with both the default and the optimized (-o) choice of k
+// (with -cost, only the engines and bounds that support weights)
+// return the number of mismatches found
+int verifyEngines(const Dictionary &dictionary, string_view y) {
+    int mismatches = 0;
+    vector<int> bound;
+    if (dictIndex.built)
+        qgramBounds(y, dictionary.size(), bound);
+    bool useTrie = trie.built && !costModel;
+    int maxLevel = costModel ? -1 : simdLevel;
+    // trie distances without and with -o
+    vector<int> trieDist[2];
+    if (useTrie) {
+        bool oldOptO = opt_o;
+        for (int o = 0; o < 2; o++) {
+            opt_o = o;
+            trieDistances(dictionary, y, trieDist[o], opt_j);
+        }
+        opt_o = oldOptO;
+    }
+    // -o distances of the length buckets (exact, so not bounded by -b)
+    vector<int> bucketDist(dictionary.size());
+    {
+        bool oldOptO = opt_o, oldOptB = opt_b;
+        opt_o = 1;
+        opt_b = 0;
+        bucketDistances(dictionary, y, bucketDist, opt_j);
+        expandDuplicates(dictionary, bucketDist);
+        opt_o = oldOptO;
+        opt_b = oldOptB;
+    }
+    // multi-query distances without and with -o, of y packed after other
+    // queries (its prefixes, and one too long to pack)
+    vector<vector<int>> multiDist[2];
+    string longer;
+    while (longer.size() <= 64)
+        longer += y;
+    vector<string_view> group = {longer};
+    for (size_t len = 1; len < y.size() && len <= 8; len++)
+        group.push_back(y.substr(0, len));
+    group.push_back(y);
+    if (!costModel) {
+        bool oldOptO = opt_o;
+        for (int o = 0; o < 2; o++) {
+            opt_o = o;
+            computeDistancesMulti(dictionary, group, multiDist[o]);
+        }
+        opt_o = oldOptO;
+    }
+    // batched simd distances for every instruction set this CPU supports
+    vector<int> simdDist[NUM_SIMD_LEVELS][2];
+    for (int level = 0; level <= maxLevel; level++) {
+        bool oldOptO = opt_o;
+        for (int o = 0; o < 2; o++) {
+            opt_o = o;
+            simdDistances(dictionary, y, (SimdLevel)level, simdDist[level][o], opt_j);
+            expandDuplicates(dictionary, simdDist[level][o]);
+        }
+        opt_o = oldOptO;
+    }
+    for (size_t w = 0; w < dictionary.size(); w++) {
+        string_view x = dictionary[w];
+        size_t ks[2] = {x.size(), (size_t)max((int)x.size() - (int)y.size() + 1, 1)};
+        for (int o = 0; o < 2; o++) {
+            size_t k = ks[o];
+            int ref = costModel ? k_dist_suffix(x, y, k, *costModel) : k_dist_suffix(x, y, k, UnitCost());
+            for (int level = 0; level <= maxLevel; level++) {
+                if (simdDist[level][o][w] != ref) {
+                    cout << "MISMATCH simd " << simdNames[level] << " x=" << x << " y=" << y
+                         << " k=" << k << ": " << simdDist[level][o][w] << " != " << ref << "\n";
+                    mismatches++;
+                }
+            }
+            if (o == 1 && bucketDist[w] != ref) {
+                cout << "MISMATCH length bucket x=" << x << " y=" << y << " k=" << k << ": "
+                     << bucketDist[w] << " != " << ref << "\n";
+                mismatches++;
+            }
+            if (!costModel && multiDist[o].back()[w] != ref) {
+                cout << "MISMATCH multi-query x=" << x << " y=" << y << " k=" << k << ": "
+                     << multiDist[o].back()[w] << " != " << ref << "\n";
+                mismatches++;
+            }
+            // the unpacked query, scored by the block kernel
+            if (!costModel) {
+                size_t longK = o ? max((int)x.size() - (int)longer.size() + 1, 1) : x.size();
+                int longRef = k_dist_suffix(x, longer, longK, UnitCost());
+                if (multiDist[o][0][w] != longRef) {
+                    cout << "MISMATCH multi-query x=" << x << " y=" << longer << " k=" << longK << ": "
+                         << multiDist[o][0][w] << " != " << longRef << "\n";
+                    mismatches++;
+                }
+            }
+            if (useTrie && trieDist[o][w] != ref) {
+                cout << "MISMATCH trie x=" << x << " y=" << y << " k=" << k << ": "
+                     << trieDist[o][w] << " != " << ref << "\n";
+                mismatches++;
+            }
+            if (!costModel && (dictionary.uniqueMask[dictionary.uniqueId[w]] & charMask(y)) == 0
+                && ref != (int)y.size()) {
+                cout << "MISMATCH disjoint word x=" << x << " y=" << y << " k=" << k << ": "
+                     << ref << " != |y|\n";
+                mismatches++;
+            }
+            Alignment a = costModel ? alignWord(x, y, k, 0, *costModel) : alignWord(x, y, k, 0, UnitCost());
+            int applied = costModel ? scriptCost(x, y, a, *costModel) : scriptCost(x, y, a, UnitCost());
+            if (a.dist != ref || a.start >= k || applied != ref) {
+                cout << "MISMATCH alignment x=" << x << " y=" << y << " k=" << k << ": " << a.dist << " ["
+                     << a.start << ", " << a.end << ") " << a.script << " vs " << ref << "\n";
+                mismatches++;
+            }
+            if (histogramBound(x, y) > ref) {
+                cout << "MISMATCH histogram bound x=" << x << " y=" << y << "\n";
+                mismatches++;
+            }
+            if (!bound.empty() && bound[w] > ref) {
+                cout << "MISMATCH q-gram bound x=" << x << " y=" << y << "\n";
+                mismatches++;
+            }
+            for (int e = 0; e < NUM_ENGINES; e++) {
+                Engine oldEngine = opt_engine;
+                opt_engine = (Engine)e;
+                int dist = k_dist(x, y, k);
+                opt_engine = oldEngine;
+                if (dist != ref) {
+                    cout << "MISMATCH engine=" << engineNames[e] << " x=" << x
+                         << " y=" << y << " k=" << k << ": " << dist
+                         << " != " << ref << "\n";
+                    mismatches++;
+                }
+                // bounded: exact at cutoff = ref, above the cutoff at ref - 1
+                opt_engine = (Engine)e;
+                int atRef = k_dist(x, y, k, ref);
+                int belowRef = k_dist(x, y, k, ref - 1);
+                opt_engine = oldEngine;
+                if (atRef != ref || belowRef <= ref - 1) {
+                    cout << "MISMATCH engine=" << engineNames[e] << " x=" << x
+                         << " y=" << y << " k=" << k << " bounded: " << atRef
+                         << ", " << belowRef << " vs " << ref << "\n";
+                    mismatches++;
+                }
+            }
+        }
+    }
+    return mismatches;
+}
+
+// the -v command: verifyEngines (and the index) on n noisy versions of
+// random substrings of random words, made from seed. prints the totals and
+// returns the number of mismatches
+int verifyQueries(const Dictionary &dictionary, int n, int seed) {
+    bool oldOptWf = opt_wf;
+    opt_wf = 0;
+    int totalMismatches = 0;
+    int totalQueries = 0;
+    for (int q = 0; q < n; q++) {
+        // noisy version of a random substring of a random word
+        StreamRng rng(seed, q);
+        string_view word = dictionary[rng.below(dictionary.size())];
+        size_t l = rng.below(word.size()) + 1;
+        string str(word.substr(rng.below(word.size() - l + 1), l));
+        string y = randomEdit(str, rng.below(4), rng);
+        if (y.size() == 0)
+            continue;
+        totalMismatches += verifyEngines(dictionary, y);
+        if (dictIndex.built) {
+            // the index must find the same words as string::find
+            set<string_view> indexed = answerSet(dictionary, y);
+            set<string_view> scanned;
+            for (size_t w = 0; w < dictionary.size(); w++)
+                if (dictionary[w].find(y) != string_view::npos)
+                    scanned.insert(dictionary[w]);
+            if (indexed != scanned) {
+                cout << "MISMATCH answerSet y=" << y << "\n";
+                totalMismatches++;
+            }
+        }
+        totalQueries++;
+    }
+    opt_wf = oldOptWf;
+    cout << "\nTotal queries: " << totalQueries;
+    cout << "\nTotal mismatches: " << totalMismatches;
+    cout << "\n" << (totalMismatches == 0 ? "PASS" : "FAIL") << "\n\n";
+    return totalMismatches;
+}
+
+// -verify: the -v command with a fixed seed instead of the Input > prompt,
+// exiting with status 1 on any mismatch, so that scripts can run it
+int opt_verify = 0;
+const int VERIFY_SEED = 1;
+
+// benchmark.cpp includes this file for everything but main
+#ifndef NOISY_NO_MAIN
 int main(int argc, char **argv) {
 
     if (argc <= 1 || argv[1][0] == '-') {
@@ -247,28 +3877,123 @@ int main(int argc, char **argv) {
             opt_o = 1;
         else if (strcmp(argv[i], "-cnt") == 0)
             opt_cnt = 1;
+        else if (strcmp(argv[i], "-b") == 0)
+            opt_b = 1;
+        else if (strcmp(argv[i], "-idx") == 0)
+            opt_idx = 1;
+        else if (strcmp(argv[i], "-trie") == 0)
+            opt_trie = 1;
+        else if (strcmp(argv[i], "-ta") == 0)
+            opt_ta = 1;
+        else if (strcmp(argv[i], "-word") == 0)
+            opt_word = 1;
+        else if (strcmp(argv[i], "-bk") == 0)
+            opt_word = opt_bk = 1;
+        else if (strcmp(argv[i], "-align") == 0)
+            opt_align = 1;
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            opt_j = max(atoi(argv[++i]), 1);
+        else if ((strcmp(argv[i], "-k") == 0 || strcmp(argv[i], "-r") == 0) && i + 1 < argc) {
+            // at least 1 nearest word, or a radius of at least 0
+            int n = atoi(argv[i + 1]);
+            if (n < (argv[i][1] == 'k' ? 1 : 0))
+                cout << "Unrecognized argument: " << argv[i] << " " << argv[i + 1] << "\n";
+            else if (argv[i][1] == 'k')
+                opt_k = n;
+            else
+                opt_r = n;
+            i++;
+        }
+        else if (strcmp(argv[i], "-cost") == 0 && i + 1 < argc)
+            opt_cost = argv[++i];
+        else if (strcmp(argv[i], "-metrics") == 0 && i + 1 < argc)
+            opt_metrics = argv[++i];
+        else if (strcmp(argv[i], "-batch") == 0 && i + 1 < argc)
+            opt_batch = argv[++i];
+        else if (strcmp(argv[i], "-verify") == 0 && i + 1 < argc)
+            opt_verify = max(atoi(argv[++i]), 0);
+        else if (strcmp(argv[i], "-serve") == 0 && i + 1 < argc)
+            opt_serve = argv[++i];
+        else if (strcmp(argv[i], "-cache") == 0 && i + 1 < argc)
+            opt_cache = max(atoi(argv[++i]), 0);
+        else if (strcmp(argv[i], "-fmt") == 0 && i + 1 < argc) {
+            int f = 0;
+            for (; f < NUM_FORMATS && strcmp(argv[i + 1], formatNames[f]) != 0; f++);
+            if (f == NUM_FORMATS)
+                cout << "Unrecognized format: " << argv[i + 1] << "\n";
+            else
+                opt_format = (BatchFormat)f;
+            i++;
+        }
+        else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            int e = 0;
+            for (; e < NUM_ENGINES && strcmp(argv[i + 1], engineNames[e]) != 0; e++);
+            if (e == NUM_ENGINES)
+                cout << "Unrecognized engine: " << argv[i + 1] << "\n";
+            else
+                opt_engine = (Engine)e;
+            i++;
+        }
         else
             cout << "Unrecognized argument: " << argv[i] << "\n";
     }
 
-    ifstream in_file;
-    in_file.open(argv[1]);
-    if (in_file.fail()) {
-        perror("Failed to open input file\n");
-        exit(1);
+    simdLevel = simdDetect();
+
+    Dictionary dictionary;
+    {
+        PHASE_TIMER(M_NS_LOAD);
+        loadDictionary(argv[1], dictionary);
+        if (opt_cost) {
+            loadCostModel(opt_cost, weightedCost);
+            costModel = &weightedCost;
+        }
+        if (opt_idx)
+            buildIndex(dictionary);
+        if (opt_trie)
+            buildTrie(dictionary);
+        if (opt_bk && !costModel)
+            buildBKTree(dictionary);
     }
-    vector<string> dictionary;
-    for (string x; !in_file.eof();) {
-        in_file >> x;
-        transform(x.begin(), x.end(), x.begin(), ::tolower);
-        if (x.length() > 0)
-            dictionary.push_back(x);
+    cerr << "Dictionary: " << dictionary.size() << " words, " << dictionary.numUnique() << " distinct ("
+         << dictionary.size() - dictionary.numUnique() << " duplicates scored once)\n";
+
+    if (opt_verify > 0)
+        return verifyQueries(dictionary, opt_verify, VERIFY_SEED) == 0 ? 0 : 1;
+
+    if (opt_serve) {
+        // the replies are only the results, so there is no -wf matrix
+        opt_wf = 0;
+        runServer(dictionary, opt_serve);
+    }
+
+    if (opt_batch) {
+        // the output is only the results, so there is no -wf matrix
+        opt_wf = 0;
+        if (strcmp(opt_batch, "-") == 0)
+            runBatch(dictionary, cin, cout);
+        else {
+            ifstream batch_file(opt_batch);
+            if (batch_file.fail()) {
+                perror("Failed to open batch file\n");
+                exit(1);
+            }
+            runBatch(dictionary, batch_file, cout);
+        }
+        if (opt_cnt)
+            printMetrics(cerr, metricsTotal(), metricsTotal());
+        dumpMetrics();
+        return 0;
     }
-    in_file.close();
 
+    // distances of the last query, reused across commands
+    vector<int> distances;
+    // -ta: the state of the last query, which the next one starts from
+    TypeAheadSession session(dictionary, opt_t ? INF : TYPEAHEAD_SLACK);
+    // the first command also reports the load
+    Metrics oldMetrics;
     while (true) {
 
-        int oldCntGlobalCharComp = cntGlobalCharComp;
         cout << "Input > ";
         string in;
         getline(cin, in);
@@ -280,8 +4005,10 @@ int main(int argc, char **argv) {
         if (command.size() == 0)
             continue;
 
-        if (command[0] == "-q")
+        if (command[0] == "-q") {
+            dumpMetrics();
             exit(0);
+        }
 
         if (command[0] == "-t") {
             size_t tNumArgs = 5;
@@ -339,12 +4066,6 @@ int main(int argc, char **argv) {
             l_u = tArgs[2];
             e_l = tArgs[3];
             e_u = tArgs[4];
-            // sort dictionary by size of strings
-            vector<string> sortedDict = dictionary;
-            sort(sortedDict.begin(), sortedDict.end(),
-                [](const string &a, const string &b) -> bool {
-                    return a.size() < b.size();
-                });
             if (l_l > l_u) {
                 cout << "Argument 2: l_l of " << command[0] << " must be <= argument 3, l_u\n";
                 continue;
@@ -353,12 +4074,20 @@ int main(int argc, char **argv) {
                 cout << "Argument 4: e_l of " << command[0] << " must be <= argument 5, e_u\n";
                 continue;
             }
+            if (!(geom_param > 0 && geom_param <= 1)) {
+                cout << "-g must be followed by a parameter in (0, 1]\n";
+                continue;
+            }
 
             /* Dictionary properties */
-            size_t longest = sortedDict[sortedDict.size() - 1].size();
-            size_t smallestValidIndex = 0;
-            for (; sortedDict[smallestValidIndex].size() <= l_l; smallestValidIndex++);
-            size_t rangeSize = sortedDict.size() - smallestValidIndex;
+            // the words longer than l_l are a suffix of the length order
+            size_t longest = dictionary.lengthStart.size() - 2;
+            if (l_l >= longest) {
+                cout << "No word of the dictionary is longer than l_l\n";
+                continue;
+            }
+            size_t smallestValidIndex = dictionary.lengthStart[l_l + 1];
+            size_t rangeSize = dictionary.size() - smallestValidIndex;
 
             /* Output things */
             int totalCases = n;
@@ -374,54 +4103,68 @@ int main(int argc, char **argv) {
                      << setw(8) << "Success" << "\n";
             }
 
-            /* RNG things */
-            srand(seed);
-            geometric_distribution<int> geom_dist(geom_param);
-            default_random_engine generator(seed);
-
-            while (n--) {
-                /* DO TEST */
+            /* DO TESTS */
+            // trial t draws from stream (seed, t) and is scored on a single
+            // thread, with -j trials at once. the results are reduced in
+            // trial order, so the output is the same for any -j
+            struct Trial {
+                string word, str, y; // kept for -o only
+                size_t estSize, ansSize;
+                bool success;
+            };
+            vector<Trial> trials(n);
+            int numThreads = opt_wf ? 1 : opt_j;
+            vector<vector<int>> distancesOf(numThreads);
+            runWorkStealing(n, numThreads, [&](size_t t, int w) {
+                StreamRng rng(seed, t);
                 // pick random word
-                string word = sortedDict[(rand() % rangeSize) + smallestValidIndex];
+                string_view word = dictionary[dictionary.byLength[rng.below(rangeSize) + smallestValidIndex]];
                 // pick length of substring of word
-                int l = rand() % (min(l_u, word.length() - 1) - l_l + 1) + l_l;
+                size_t l = rng.below(min(l_u, word.length() - 1) - l_l + 1) + l_l;
                 // pick location of substring
-                int substrloc = rand() % (word.length() - l + 1);
+                size_t substrloc = rng.below(word.length() - l + 1);
 
-                string str = word.substr(substrloc, l);
+                string str(word.substr(substrloc, l));
                 // pick number of edits
-                size_t e = (geom_dist(generator) % (e_u - e_l + 1)) + e_l;
+                size_t e = (rng.geometric(geom_param) % (e_u - e_l + 1)) + e_l;
                 // edit word
-                string y = randomEdit(str, e);
+                string y = randomEdit(str, e, rng);
                 // Run noisy substring algorithm on y
-                vector<int> distances = computeDistances(dictionary, y);
+                vector<int> &dist = distancesOf[w];
+                computeDistances(dictionary, y, dist, 1);
                 int minDist = INF;
-                for (int dist: distances)
-                    minDist = min(dist, minDist);
+                for (int d: dist)
+                    minDist = min(d, minDist);
                 // Get set of strings which are closest
-                set<string> closest;
+                set<string_view> closest;
                 for (size_t i = 0; i < dictionary.size(); i++)
-                    if (distances[i] == minDist)
+                    if (dist[i] == minDist)
                         closest.insert(dictionary[i]);
                 // Get set of strings which are the "answer"
-                set<string> answer = answerSet(dictionary, str);
+                set<string_view> answer = answerSet(dictionary, str);
                 // check if answer is a subset of closest
-                bool success = 1;
-                for (string x: answer) {
-                    if (closest.find(x) == closest.end()) {
-                        success = 0;
-                        break;
-                    }
+                Trial &trial = trials[t];
+                trial.success = includes(closest.begin(), closest.end(), answer.begin(), answer.end());
+                trial.estSize = closest.size();
+                trial.ansSize = answer.size();
+                if (topt_o) {
+                    trial.word = word;
+                    trial.str = move(str);
+                    trial.y = move(y);
                 }
-                if (success)
+            });
+
+            PHASE_TIMER(M_NS_OUTPUT);
+            for (Trial &trial: trials) {
+                if (trial.success)
                     totalSuccesses++;
-                double ratio = (double)((double)closest.size() / (double)answer.size());
+                double ratio = (double)((double)trial.estSize / (double)trial.ansSize);
                 avgRatio += ratio;
-                avgEstSize += closest.size();
+                avgEstSize += trial.estSize;
                 if (topt_o) {
-                    cout << setw(outw) << word << setw(outw) << str << setw(outw) << y
-                         << setw(9) << closest.size() << setw(9) << answer.size()
-                         << setw(8) << ratio << setw(8) << (success ? "true" : "false") << "\n";
+                    cout << setw(outw) << trial.word << setw(outw) << trial.str << setw(outw) << trial.y
+                         << setw(9) << trial.estSize << setw(9) << trial.ansSize
+                         << setw(8) << ratio << setw(8) << (trial.success ? "true" : "false") << "\n";
                 }
             }
             avgRatio /= totalCases;
@@ -432,10 +4175,54 @@ int main(int argc, char **argv) {
             cout << "\nAverage estimate-size to answer-size ratio: " << avgRatio;
             cout << "\nFrequency: " << (double)totalSuccesses / (double)totalCases << "\n\n";
         }
+        else if (command[0] == "-v") {
+            // verify engines against each other
+            if (command.size() < 2) {
+                cout << "Not enough inputs specified for command " << command[0] << "\n";
+                continue;
+            }
+            int n;
+            try {
+                n = stoi(command[1]);
+            } catch (...) {
+                cout << "Argument 1 of " << command[0] << " must be a positive integer\n";
+                continue;
+            }
+            int seed = time(NULL);
+            bool badSeed = 0;
+            for (size_t i = 2; i < command.size(); i++) {
+                if (command[i] == "-s" && i + 1 < command.size()) {
+                    try {
+                        seed = stoi(command[++i]);
+                    } catch (...) {
+                        cout << "-s must be followed by an integer representing a seed\n";
+                        badSeed = 1;
+                    }
+                }
+                else
+                    cout << "Unrecognized argument: " << command[i] << "\n";
+            }
+            if (!badSeed)
+                verifyQueries(dictionary, n, seed);
+        }
+        else if (nearestMode()) {
+            // only the ranked list of -k and -r, which needs no other distance
+            vector<Neighbor> neighbors;
+            nearestWords(dictionary, command[0], neighbors);
+            PHASE_TIMER(M_NS_OUTPUT);
+            cout << "\n";
+            for (Neighbor n: neighbors)
+                cout << n.dist << "\t" << dictionary[n.id] << "\n";
+            cout << "\n\n";
+        }
         else {
             // Run noisy substring algorithm on command[0] (str input)
             string y = command[0];
-            vector<int> distances = computeDistances(dictionary, y);
+            if (typeAheadMode()) {
+                session.type(y);
+                distances = session.distances();
+            } else
+                computeDistances(dictionary, y, distances);
 
             int minDist = INF;
             for (int dist: distances) {
@@ -443,14 +4230,32 @@ int main(int argc, char **argv) {
                     minDist = dist;
             }
 
+            // -align: the best substring of every closest (distinct) word
+            unordered_map<uint32_t, Alignment> alignments;
+            if (opt_align) {
+                PHASE_TIMER(M_NS_SCORE);
+                for (size_t i = 0; i < dictionary.size(); i++)
+                    if (distances[i] == minDist && dictionary.isFirstCopy(i))
+                        alignments[dictionary.uniqueId[i]] = alignWord(dictionary[i], y);
+            }
+
             /* OUTPUT */
+            PHASE_TIMER(M_NS_OUTPUT);
             cout << "\n";
             if (opt_h) {
                 cout << "\e[0;32;40m ";
                 for (size_t i = 0; i < dictionary.size(); i++) {
-                    if (distances[i] == minDist)
-                        cout << "\e[0;30;47m";
-                    cout << dictionary[i];
+                    string_view x = dictionary[i];
+                    if (distances[i] != minDist)
+                        cout << x;
+                    else if (!opt_align)
+                        cout << "\e[0;30;47m" << x;
+                    else {
+                        // only the substring that matches y
+                        const Alignment &a = alignments[dictionary.uniqueId[i]];
+                        cout << x.substr(0, a.start) << "\e[0;30;47m" << x.substr(a.start, a.end - a.start)
+                             << "\e[0;32;40m" << x.substr(a.end);
+                    }
                     cout << "\e[0;32;40m ";
                 }
                 cout << "\e[0m\n\n";
@@ -470,13 +4275,21 @@ int main(int argc, char **argv) {
                     cout << w.first << "\t" << dictionary[w.second] << "\n";
                 cout << "\n\n";
             }
+            if (opt_align) {
+                for (size_t i = 0; i < dictionary.size(); i++) {
+                    if (distances[i] != minDist || !dictionary.isFirstCopy(i))
+                        continue;
+                    const Alignment &a = alignments[dictionary.uniqueId[i]];
+                    cout << dictionary[i] << "\t" << a.start << "\t" << a.end << "\t" << a.script << "\n";
+                }
+                cout << "\n\n";
+            }
         }
-        if (opt_cnt) {
-            cout << "Total comparisons during last command: "
-                 << cntGlobalCharComp - oldCntGlobalCharComp << "\n";
-            cout << "Total comparisons since beginning of program: "
-                 << cntGlobalCharComp << "\n";
-        }
+        Metrics metrics = metricsTotal();
+        if (opt_cnt)
+            printMetrics(cout, metrics - oldMetrics, metrics);
+        oldMetrics = metrics;
         cout << "\n";
     }
 }
+#endif
@@ -0,0 +1,24 @@
+#!/bin/sh
+# Checks the engines against each other (noisysubstring -verify) on every
+# shipped dictionary, and exits with a non-zero status at the first one
+# with a mismatch.
+#
+# Usage: ./verify.sh [noisysubstring binary] [queries per dictionary]
+#     (./noisysubstring and 20 by default)
+
+bin=${1:-./noisysubstring}
+queries=${2:-20}
+dir=$(dirname "$0")
+
+if [ ! -x "$bin" ]; then
+    echo "No executable $bin; build it first (see README.md)" >&2
+    exit 2
+fi
+
+for d in "$dir"/dictionary/*.txt; do
+    if ! "$bin" "$d" -verify "$queries" > /dev/null; then
+        echo "FAIL $d"
+        exit 1
+    fi
+    echo "PASS $d"
+done